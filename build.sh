@@ -7,7 +7,7 @@ usage() {
     echo "  build  : Compiles the project."
     echo "  debug  : Compiles the project with debugging symbols."
     echo "  clean  : Removes the compiled executable."
-    echo "  exp    : Run experiment."
+    echo "  exp    : Run experiment (experimentos/<name>.c, default: recv)."
     exit 1
 }
 
@@ -16,7 +16,7 @@ case "$1" in
         if [ -f "main" ]; then
             rm -f "main"
         fi
-        clang -O2 -std=c11 -Wall -Werror main.c -o main
+        clang -O2 -std=c11 -pthread -Wall -Werror main.c -o main
         ./main
         ;;
     "macos")
@@ -27,21 +27,21 @@ case "$1" in
         ./main
         ;;
     "build")
-        clang -O2 -std=c11 -Wall -Werror main.c -o main
+        clang -O2 -std=c11 -pthread -Wall -Werror main.c -o main
         ;;
     "debug")
         if [ -f "main" ]; then
             rm -f "main"
         fi
-        clang -g -std=c11 -Wall -Werror main.c -o main
+        clang -g -std=c11 -pthread -Wall -Werror main.c -o main
         # gdb -q -ex "set debuginfod enabled off" -ex "layout src" -ex "break main" -ex "run" ./main
         ;;
     "exp")
         if [ -f "exp" ]; then
             rm -f "exp"
         fi
-        clang -O2 -std=c11 -Wall -Werror experimentos/recv.c -o exp
-        ./exp
+        clang -O2 -std=c11 -pthread -Wall -Werror "experimentos/${2:-recv}.c" -o exp
+        ./exp "${@:3}"
         rm -f "exp"
         ;;
     "clean")
@@ -0,0 +1,204 @@
+/*
+ * Memoria que se quedan las conexiones keep-alive despues de una respuesta
+ * grande, con y sin high water mark en las arenas de los contextos.
+ *
+ * Uso: ./build.sh exp arena_rss [conexiones] [KB de la respuesta]
+ *
+ * Cada conexion pide una respuesta grande, que se codifica en la arena de
+ * salida del contexto, y despues queda con el proximo request a medias,
+ * asi cada una se queda con su contexto. Sin high water mark las paginas
+ * que toco la respuesta siguen residentes; con el high water mark
+ * arena_reset las devuelve con MADV_DONTNEED. Los numeros salen de
+ * http_server_get_memory_stats, que el server expone en /stats.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#include <sys/wait.h>
+
+#define BENCH_PORT 8896
+#define MAX_CLIENTS 1024
+
+static u16 bench_port = BENCH_PORT;
+
+static Server *bench_server;
+static u8 *big_body;
+static u32 big_size;
+
+static void handle_big(Request *request, Response *response) {
+    http_response_write(response, big_body, big_size);
+}
+
+static void handle_stats(Request *request, Response *response) {
+    Memory_Stats stats = http_server_get_memory_stats(bench_server);
+
+    // http_response_write no copia, la respuesta se codifica despues del handler
+    static char text[256];
+    i32 size = snprintf(text, sizeof(text), "%lu %u %u %u %lu %lu",
+                        stats.rss_bytes, stats.connections_open, stats.contexts_count,
+                        stats.contexts_in_use, stats.receive_buffers_bytes, stats.rss_per_connection);
+    http_response_write(response, (u8 *)text, size);
+}
+
+static pid_t server_spawn(u64 high_water_mark) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        big_body = malloc(big_size);
+        memset(big_body, 'a', big_size);
+
+        Arena *arena = arena_make(1 * MB);
+        bench_server = http_server_make(arena);
+        http_server_set_workers(bench_server, 1);
+        http_server_set_arena_high_water_mark(bench_server, high_water_mark);
+        http_server_handle(bench_server, "GET /big", &handle_big);
+        http_server_handle(bench_server, "GET /stats", &handle_stats);
+        exit(http_server_start(bench_server, bench_port, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+static i32 client_connect(void) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(bench_port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool client_send_get(i32 fd, char *path) {
+    char request[128];
+    i32 request_size = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", path);
+    return write(fd, request, request_size) == request_size;
+}
+
+/*
+ * Lee una respuesta entera. Los primeros body_capacity - 1 bytes del body
+ * quedan en body, terminados en 0.
+ */
+static bool client_read_response(i32 fd, char *body, u32 body_capacity) {
+    static char buffer[64 * KB];
+    u32 used = 0;
+    char *body_start = NULL;
+    u64 body_size = 0;
+
+    while (body_start == NULL) {
+        i64 n = read(fd, buffer + used, sizeof(buffer) - used - 1);
+        if (n <= 0) {
+            return false;
+        }
+        used += n;
+        buffer[used] = 0;
+
+        char *headers_end = strstr(buffer, "\r\n\r\n");
+        if (headers_end) {
+            char *content_length = strcasestr(buffer, "content-length: ");
+            body_size = content_length ? strtoull(content_length + 16, NULL, 10) : 0;
+            body_start = headers_end + 4;
+        }
+    }
+
+    u64 received = buffer + used - body_start;
+    u32 copy = received < body_capacity - 1 ? received : body_capacity - 1;
+    memcpy(body, body_start, copy);
+    body[copy] = 0;
+
+    while (received < body_size) {
+        i64 n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return false;
+        }
+        received += n;
+    }
+
+    return true;
+}
+
+static bool client_get(i32 fd, char *path, char *body, u32 body_capacity) {
+    return client_send_get(fd, path) && client_read_response(fd, body, body_capacity);
+}
+
+static void bench_high_water_mark(u64 high_water_mark, u32 clients_count) {
+    bench_port++;
+    pid_t pid = server_spawn(high_water_mark);
+
+    i32 stats_fd = client_connect();
+    if (stats_fd == -1) {
+        printf("no se pudo conectar\n");
+        kill(pid, SIGINT);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    char text[256];
+    client_get(stats_fd, "/stats", text, sizeof(text));
+    u64 rss_start = strtoull(text, NULL, 10);
+
+    // con un request a medias la conexion no devuelve el contexto, asi que
+    // cada una usa el suyo en vez de reciclar el de la anterior
+    i32 fds[MAX_CLIENTS];
+    u32 ok = 0;
+    for (u32 i = 0; i < clients_count; i++) {
+        fds[i] = client_connect();
+        char body[16];
+        if (fds[i] != -1 && client_get(fds[i], "/big", body, sizeof(body))) {
+            ok++;
+            write(fds[i], "GET /big HTTP/1.1\r\n", 19);
+        }
+    }
+    usleep(100 * 1000);
+    Memory_Stats stats = {0};
+    client_get(stats_fd, "/stats", text, sizeof(text));
+    sscanf(text, "%lu %u %u %u %lu %lu", &stats.rss_bytes, &stats.connections_open, &stats.contexts_count,
+           &stats.contexts_in_use, &stats.receive_buffers_bytes, &stats.rss_per_connection);
+
+    printf("%14lu %8d %8d %14lu %14lu %14lu %10u\n", high_water_mark / KB, clients_count, ok,
+           rss_start / KB, stats.rss_bytes / KB, (stats.rss_bytes - rss_start) / KB / clients_count,
+           stats.contexts_count);
+
+    for (u32 i = 0; i < clients_count; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    close(stats_fd);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+    u32 clients_count = argc > 1 ? atoi(argv[1]) : 200;
+    big_size = (argc > 2 ? atoi(argv[2]) : 512) * KB;
+
+    clients_count = clients_count > MAX_CLIENTS ? MAX_CLIENTS : clients_count;
+    clients_count = clients_count == 0 ? 1 : clients_count;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("respuesta de %d KB por conexion\n", big_size / KB);
+    printf("%14s %8s %8s %14s %14s %14s %10s\n",
+           "high water KB", "conex", "ok", "RSS inicio KB", "RSS final KB", "KB por conex", "contextos");
+
+    bench_high_water_mark(0, clients_count);
+    bench_high_water_mark(CONTEXT_ARENA_HIGH_WATER_MARK, clients_count);
+    bench_high_water_mark(16 * KB, clients_count);
+
+    return 0;
+}
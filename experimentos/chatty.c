@@ -0,0 +1,157 @@
+/*
+ * Conexiones que mandan el request de a un byte: memoria del server y si
+ * los requests terminan bien.
+ *
+ * Uso: ./build.sh exp chatty [conexiones] [bytes de headers]
+ *
+ * Cada conexion manda un request con headers largos de a un byte por
+ * write, todas intercaladas, asi el server hace un read por byte. Los
+ * reads se van juntando en el mismo Parser_Buffer, que sale del pool del
+ * worker, en vez de pedir un buffer nuevo por read. Se mira el VmRSS del
+ * server con los requests a medias y al final.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 8895
+#define MAX_CLIENTS 1024
+
+static u16 bench_port = BENCH_PORT;
+
+static void handle_ok(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"ok", 2);
+}
+
+static u64 process_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    u64 rss = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmRSS: %lu kB", &rss) == 1) {
+            break;
+        }
+    }
+
+    fclose(file);
+    return rss;
+}
+
+static pid_t server_spawn(Events_Backend backend) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(1 * MB);
+        Server *server = http_server_make(arena);
+        http_server_set_backend(server, backend);
+        http_server_set_workers(server, 1);
+        http_server_handle(server, "GET /", &handle_ok);
+        exit(http_server_start(server, bench_port, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+static void bench_backend(char *name, Events_Backend backend, u32 clients_count, u32 headers_size) {
+    bench_port++;
+    pid_t pid = server_spawn(backend);
+
+    u64 rss_start = process_rss_kb(pid);
+
+    // headers de 256 bytes hasta llegar a headers_size
+    char *request = malloc(headers_size + 512);
+    u32 request_size = sprintf(request, "GET / HTTP/1.1\r\nHost: bench\r\n");
+    while (request_size + 256 <= headers_size) {
+        request_size += sprintf(request + request_size, "X-Filler: %0244d\r\n", request_size);
+    }
+    request_size += sprintf(request + request_size, "\r\n");
+
+    i32 fds[MAX_CLIENTS];
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(bench_port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    for (u32 i = 0; i < clients_count; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        i32 one = 1;
+        setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fds[i], (struct sockaddr *)&address, sizeof(address)) == -1) {
+            printf("no se pudo conectar\n");
+            exit(1);
+        }
+    }
+
+    // todo menos el ultimo byte, de a uno e intercalado entre conexiones
+    for (u32 at = 0; at < request_size - 1; at++) {
+        for (u32 i = 0; i < clients_count; i++) {
+            write(fds[i], request + at, 1);
+        }
+        if (at % 64 == 0) {
+            usleep(100);
+        }
+    }
+
+    usleep(200 * 1000);
+    u64 rss_partial = process_rss_kb(pid);
+
+    for (u32 i = 0; i < clients_count; i++) {
+        write(fds[i], request + request_size - 1, 1);
+    }
+
+    u32 ok = 0;
+    for (u32 i = 0; i < clients_count; i++) {
+        char buffer[512];
+        i64 n = read(fds[i], buffer, sizeof(buffer));
+        if (n > 12 && memcmp(buffer, "HTTP/1.1 200", 12) == 0) {
+            ok++;
+        }
+    }
+
+    u64 rss_end = process_rss_kb(pid);
+
+    printf("%10s %8d %10d %12lu %14lu %12lu %8d\n", name, clients_count, request_size,
+           rss_start, rss_partial, rss_end, ok);
+
+    for (u32 i = 0; i < clients_count; i++) {
+        close(fds[i]);
+    }
+    free(request);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+    u32 clients_count = argc > 1 ? atoi(argv[1]) : 200;
+    u32 headers_size = argc > 2 ? atoi(argv[2]) : 2 * KB;
+
+    clients_count = clients_count > MAX_CLIENTS ? MAX_CLIENTS : clients_count;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%10s %8s %10s %12s %14s %12s %8s\n",
+           "backend", "conex", "bytes", "RSS inicio", "RSS a medias", "RSS final", "ok");
+
+    bench_backend("epoll", EVENTS_BACKEND_EPOLL, clients_count, headers_size);
+    bench_backend("io_uring", EVENTS_BACKEND_IO_URING, clients_count, headers_size);
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Respuestas a HEAD: los bytes que salen por el socket.
+ *
+ * Uso: ./build.sh exp head
+ *
+ * Una conexion keep-alive manda de una vez varios HEAD y GET (pipelining)
+ * y lee todo lo que contesta el server hasta que cierra. Las respuestas se
+ * separan a mano con el Content-Length, como haria un cliente: a un HEAD
+ * no le puede seguir ningun body, si no el cliente lo lee como el comienzo
+ * de la respuesta siguiente. Los HEAD pegan en una ruta de GET, en una de
+ * GET que corre en el pool de offload, en una registrada como HEAD y en una
+ * que no existe. Se corre con epoll y con io_uring.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#include <sys/wait.h>
+
+#define BENCH_PORT 8897
+#define MAX_RESPONSES 8
+
+static u16 bench_port = BENCH_PORT;
+
+typedef struct {
+    char *request_line;
+    u32 status;
+    u32 content_length;
+    char *body; // lo que tiene que llegar despues de los headers
+} Head_Case;
+
+static Head_Case head_cases[] = {
+    {"HEAD /hello",   200, 5, ""},
+    {"GET /hello",    200, 5, "hello"},
+    {"HEAD /slow",    200, 4, ""},
+    {"HEAD /only",    200, 4, ""},
+    {"HEAD /missing", 404, 0, ""},
+    {"GET /hello",    200, 5, "hello"},
+};
+
+static void handle_hello(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"hello", 5);
+}
+
+static void handle_slow(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"slow", 4);
+}
+
+static void handle_head(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"head", 4);
+}
+
+static pid_t server_spawn(Events_Backend backend) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(1 * MB);
+        Server *server = http_server_make(arena);
+        http_server_set_backend(server, backend);
+        http_server_set_workers(server, 1);
+        http_server_handle(server, "GET /hello", &handle_hello);
+        http_server_handle_with_flags(server, "GET /slow", &handle_slow, HANDLER_FLAG_BLOCKING);
+        http_server_handle(server, "HEAD /only", &handle_head);
+        exit(http_server_start(server, bench_port, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+/*
+ * Manda todos los casos en un solo write, el ultimo con Connection: close,
+ * y lee hasta que el server cierra. Devuelve los bytes leidos.
+ */
+static u32 client_exchange(char *received, u32 capacity) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(bench_port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    struct timeval timeout = {.tv_sec = 2};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    u32 cases_count = sizeof(head_cases) / sizeof(head_cases[0]);
+
+    char batch[2048];
+    u32 batch_size = 0;
+    for (u32 i = 0; i < cases_count; i++) {
+        bool is_last = i == cases_count - 1;
+        batch_size += snprintf(batch + batch_size, sizeof(batch) - batch_size,
+                               "%s HTTP/1.1\r\nHost: bench\r\n%s\r\n", head_cases[i].request_line,
+                               is_last ? "Connection: close\r\n" : "");
+    }
+    write(fd, batch, batch_size);
+
+    u32 used = 0;
+    while (used < capacity - 1) {
+        i64 n = read(fd, received + used, capacity - 1 - used);
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+    }
+    received[used] = 0;
+
+    close(fd);
+    return used;
+}
+
+/*
+ * Separa las respuestas como un cliente y compara cada una con su caso.
+ * Devuelve cuantos casos fallaron.
+ */
+static u32 check_responses(char *name, char *received, u32 size) {
+    u32 cases_count = sizeof(head_cases) / sizeof(head_cases[0]);
+    u32 failed = 0;
+    u32 at = 0;
+
+    for (u32 i = 0; i < cases_count; i++) {
+        Head_Case *head_case = &head_cases[i];
+
+        char *response = received + at;
+        char *headers_end = at < size ? strstr(response, "\r\n\r\n") : NULL;
+        if (headers_end == NULL) {
+            printf("%10s %-14s no llego la respuesta\n", name, head_case->request_line);
+            failed += cases_count - i;
+            break;
+        }
+
+        u32 status = 0;
+        sscanf(response, "HTTP/1.1 %u", &status);
+
+        char *content_length = strcasestr(response, "content-length: ");
+        u32 length = content_length && content_length < headers_end ? strtoul(content_length + 16, NULL, 10) : 0;
+
+        // un HEAD no trae body aunque el Content-Length diga otra cosa
+        bool is_head = strncmp(head_case->request_line, "HEAD ", 5) == 0;
+        u32 body_size = is_head ? 0 : length;
+
+        char *body = headers_end + 4;
+        at = body - received + body_size;
+
+        bool ok = status == head_case->status && length == head_case->content_length &&
+                  at <= size && strncmp(body, head_case->body, body_size) == 0 &&
+                  strlen(head_case->body) == body_size;
+
+        printf("%10s %-14s %6u %14u %6u %6s\n", name, head_case->request_line, status, length,
+               body_size, ok ? "ok" : "FALLA");
+        failed += !ok;
+    }
+
+    // si a un HEAD se le mando el body, sobran bytes al final
+    if (at < size) {
+        printf("%10s sobran %u bytes despues de la ultima respuesta: \"%.*s\"\n", name, size - at,
+               size - at > 32 ? 32 : size - at, received + at);
+        failed++;
+    }
+
+    return failed;
+}
+
+static u32 run_backend(char *name, Events_Backend backend) {
+    bench_port++;
+    pid_t pid = server_spawn(backend);
+
+    static char received[16 * KB];
+    u32 size = client_exchange(received, sizeof(received));
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    return check_responses(name, received, size);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%10s %-14s %6s %14s %6s %6s\n", "backend", "request", "status", "Content-Length", "body", "");
+
+    u32 failed = run_backend("epoll", EVENTS_BACKEND_EPOLL);
+    failed += run_backend("io_uring", EVENTS_BACKEND_IO_URING);
+
+    if (failed > 0) {
+        printf("\n%u fallaron\n", failed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Memoria del server por cada conexion keep-alive ociosa.
+ *
+ * Uso: ./build.sh exp idle_connections [conexiones]
+ *
+ * Levanta el server en un proceso hijo, abre N conexiones, hace un request
+ * keep-alive en cada una y las deja abiertas sin hacer nada. Compara el RSS
+ * del server antes y despues.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 8891
+
+static void handle_ok(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"ok", 2);
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static u64 process_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    u64 rss = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmRSS: %lu kB", &rss) == 1) {
+            break;
+        }
+    }
+
+    fclose(file);
+    return rss;
+}
+
+static pid_t server_spawn(void) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(1 * MB);
+        Server *server = http_server_make(arena);
+        http_server_handle(server, "GET /", &handle_ok);
+        exit(http_server_start(server, BENCH_PORT, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    u32 connections_count = argc > 1 ? atoi(argv[1]) : 10000;
+
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t pid = server_spawn();
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(BENCH_PORT),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+    // un primer request para que el server ya tenga todo inicializado
+    i32 warmup_fd = socket(AF_INET, SOCK_STREAM, 0);
+    connect(warmup_fd, (struct sockaddr *)&address, sizeof(address));
+    write(warmup_fd, request, sizeof(request) - 1);
+    char response[256];
+    read(warmup_fd, response, sizeof(response));
+    usleep(50 * 1000);
+
+    u64 rss_before = process_rss_kb(pid);
+
+    i32 *fds = malloc(sizeof(i32) * connections_count);
+    u32 opened = 0;
+
+    for (u32 i = 0; i < connections_count; i++) {
+        i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+            printf("no se pudo abrir la conexion %d: %s\n", i, strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            break;
+        }
+
+        if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1 ||
+            read(fd, response, sizeof(response)) <= 0) {
+            printf("fallo el request de la conexion %d\n", i);
+            close(fd);
+            break;
+        }
+
+        fds[opened++] = fd;
+    }
+
+    usleep(100 * 1000);
+
+    u64 rss_after = process_rss_kb(pid);
+
+    printf("sizeof(Connection):         %zu bytes\n", sizeof(Connection));
+    printf("sizeof(Connection_Context): %zu bytes (+ arena de %d KB)\n",
+           sizeof(Connection_Context), (CONTEXT_ARENA_SIZE) / KB);
+    printf("conexiones ociosas:         %d\n", opened);
+    printf("RSS antes:                  %lu KB\n", rss_before);
+    printf("RSS despues:                %lu KB\n", rss_after);
+    if (opened > 0) {
+        printf("RSS por conexion ociosa:    %.1f bytes\n",
+               (f64)(rss_after - rss_before) * KB / opened);
+    }
+
+    for (u32 i = 0; i < opened; i++) {
+        close(fds[i]);
+    }
+    close(warmup_fd);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    return 0;
+}
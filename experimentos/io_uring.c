@@ -0,0 +1,213 @@
+/*
+ * epoll vs io_uring: requests por segundo y syscalls por request del server.
+ *
+ * Uso: ./build.sh exp io_uring [segundos por corrida] [conexiones] [pipeline]
+ *
+ * Cada conexion es keep-alive y manda `pipeline` requests juntos antes de
+ * leer las respuestas. Las syscalls del server se cuentan reemplazando las
+ * funciones que usa http.c por macros que incrementan un contador compartido
+ * con este proceso.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+
+#include <sys/wait.h>
+#include <time.h>
+
+static u64 *server_syscalls;
+
+#define count_syscall(call) (__atomic_fetch_add(server_syscalls, 1, __ATOMIC_RELAXED), call)
+
+#define read(...)        count_syscall(read(__VA_ARGS__))
+#define write(...)       count_syscall(write(__VA_ARGS__))
+#define writev(...)      count_syscall(writev(__VA_ARGS__))
+#define close(...)       count_syscall(close(__VA_ARGS__))
+#define accept(...)      count_syscall(accept(__VA_ARGS__))
+#define accept4(...)     count_syscall(accept4(__VA_ARGS__))
+#define shutdown(...)    count_syscall(shutdown(__VA_ARGS__))
+#define getpeername(...) count_syscall(getpeername(__VA_ARGS__))
+#define epoll_wait(...)  count_syscall(epoll_wait(__VA_ARGS__))
+#define epoll_ctl(...)   count_syscall(epoll_ctl(__VA_ARGS__))
+#define syscall(...)     count_syscall(syscall(__VA_ARGS__))
+
+#include "../http.c"
+
+#undef read
+#undef write
+#undef writev
+#undef close
+#undef accept
+#undef accept4
+#undef shutdown
+#undef getpeername
+#undef epoll_wait
+#undef epoll_ctl
+#undef syscall
+
+#define BENCH_PORT 8892
+#define MAX_CLIENTS 256
+
+static volatile bool bench_running = true;
+static u32 bench_pipeline = 1;
+
+typedef struct {
+    u64 requests;
+} Bench_Client;
+
+static void handle_ok(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"ok", 2);
+}
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *client_run(void *data) {
+    Bench_Client *client = (Bench_Client *)data;
+
+    static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+    static const char response_end[] = "\r\n\r\nok";
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(BENCH_PORT),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    char batch[64 * sizeof(request)];
+    u32 batch_size = 0;
+    for (u32 i = 0; i < bench_pipeline; i++) {
+        memcpy(batch + batch_size, request, sizeof(request) - 1);
+        batch_size += sizeof(request) - 1;
+    }
+
+    while (bench_running) {
+        if (write(fd, batch, batch_size) != batch_size) {
+            break;
+        }
+
+        // contar respuestas buscando el final de cada una
+        u32 responses = 0;
+        u32 matched = 0;
+        char buffer[16 * KB];
+
+        while (responses < bench_pipeline) {
+            i32 n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                close(fd);
+                return NULL;
+            }
+
+            for (i32 i = 0; i < n; i++) {
+                if (buffer[i] == response_end[matched]) {
+                    matched++;
+                    if (matched == sizeof(response_end) - 1) {
+                        responses++;
+                        matched = 0;
+                    }
+                } else {
+                    matched = buffer[i] == response_end[0] ? 1 : 0;
+                }
+            }
+        }
+
+        client->requests += responses;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static pid_t server_spawn(Events_Backend backend) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(1 * MB);
+        Server *server = http_server_make(arena);
+        http_server_set_backend(server, backend);
+        http_server_handle(server, "GET /", &handle_ok);
+        exit(http_server_start(server, BENCH_PORT, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+static void bench_backend(char *name, Events_Backend backend, f64 duration, u32 clients_count) {
+    pid_t pid = server_spawn(backend);
+
+    Bench_Client clients[MAX_CLIENTS] = {0};
+    pthread_t threads[MAX_CLIENTS];
+
+    bench_running = true;
+
+    for (u32 i = 0; i < clients_count; i++) {
+        pthread_create(&threads[i], NULL, &client_run, &clients[i]);
+    }
+
+    // no contar el accept de las conexiones
+    usleep(100 * 1000);
+    u64 requests_start = 0;
+    for (u32 i = 0; i < clients_count; i++) {
+        requests_start += clients[i].requests;
+    }
+    u64 syscalls_start = __atomic_load_n(server_syscalls, __ATOMIC_RELAXED);
+    f64 start = now_seconds();
+
+    usleep((useconds_t)(duration * 1e6));
+
+    u64 requests_end = 0;
+    for (u32 i = 0; i < clients_count; i++) {
+        requests_end += clients[i].requests;
+    }
+    u64 syscalls_end = __atomic_load_n(server_syscalls, __ATOMIC_RELAXED);
+    f64 elapsed = now_seconds() - start;
+
+    bench_running = false;
+    for (u32 i = 0; i < clients_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    u64 requests = requests_end - requests_start;
+    u64 syscalls = syscalls_end - syscalls_start;
+
+    printf("%10s %12.0f %16.3f\n", name, requests / elapsed,
+           requests > 0 ? (f64)syscalls / requests : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    f64 duration = argc > 1 ? atof(argv[1]) : 2.0;
+    u32 clients_count = argc > 2 ? atoi(argv[2]) : 32;
+    bench_pipeline = argc > 3 ? atoi(argv[3]) : 1;
+
+    clients_count = clients_count > MAX_CLIENTS ? MAX_CLIENTS : clients_count;
+    bench_pipeline = bench_pipeline > 64 ? 64 : (bench_pipeline == 0 ? 1 : bench_pipeline);
+
+    server_syscalls = mmap(0, sizeof(u64), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("conexiones: %d, pipeline: %d, %.1fs por corrida\n", clients_count, bench_pipeline, duration);
+    printf("%10s %12s %16s\n", "backend", "req/s", "syscalls/req");
+
+    bench_backend("epoll", EVENTS_BACKEND_EPOLL, duration, clients_count);
+    bench_backend("io_uring", EVENTS_BACKEND_IO_URING, duration, clients_count);
+
+    return 0;
+}
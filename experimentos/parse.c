@@ -0,0 +1,116 @@
+/*
+ * Costo de parsear un request: bytes que se piden a la arena y tiempo.
+ *
+ * Uso: ./build.sh exp parse [iteraciones]
+ *
+ * Parsea un request tipico de un navegador (cookies y user-agent largos).
+ * Los Parser_Buffer salen del pool, asi que lo que se mide en la arena es
+ * solo lo que pide el parser mientras recorre el request. Ademas lo parte
+ * en pedazos de 1 a 64 bytes, como si llegara en varios reads, y verifica
+ * que el resultado sea el mismo. Entero lo parsea parser_parse_head de una
+ * pasada; partido, la maquina de estados.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+static const char bench_request[] =
+    "GET /api/users/42/orders?page=2&limit=50 HTTP/1.1\r\n"
+    "Host: shop.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: es-AR,es;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Cookie: session_id=8f14e45fceea167a5a36dedd4bea2543; csrftoken=c9f0f895fb98ab9159f51fd0297e236d; _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1700000000; theme=dark; cart=a87ff679a2f3e71d9181a67b7542122c\r\n"
+    "Referer: https://shop.example.com/api/users/42\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Parsea el request entregandolo de a chunk_size bytes. Devuelve los bytes
+ * que pidio el parser a la arena.
+ */
+static u64 parse_in_chunks(Arena *arena, Buffer_Pool *pool, Parser *parser, Request *request, u32 chunk_size) {
+    parser_release_buffers(parser);
+    arena_reset(arena);
+    parser_init(parser, arena, pool);
+    request_init(request);
+
+    u32 sent = 0;
+    u32 request_size = sizeof(bench_request) - 1;
+
+    while (sent < request_size && parser->state != PARSER_STATE_FAILED) {
+        Parser_Buffer *buffer = parser_read_buffer(parser);
+
+        u32 space = buffer->size - buffer->used;
+        u32 size = request_size - sent < chunk_size ? request_size - sent : chunk_size;
+        size = size < space ? size : space;
+        memcpy(buffer->data + buffer->used, bench_request + sent, size);
+        buffer->used += size;
+        sent += size;
+
+        parser_parse_request(parser, request);
+    }
+
+    return arena->size;
+}
+
+static bool request_is_valid(Parser *parser, Request *request) {
+    String *cookie = http_headers_get(&request->headers_map, string_lit("cookie"));
+    String *user_agent = http_headers_get(&request->headers_map, string_lit("user-agent"));
+
+    return parser->state == PARSER_STATE_FINISHED &&
+           request->method == HTTP_METHOD_GET &&
+           string_eq(request->uri, string_lit("/api/users/42/orders?page=2&limit=50")) &&
+           string_eq(request->version, HTTP_VERSION_11) &&
+           cookie && cookie->size == 204 &&
+           user_agent && string_eq(*user_agent, string_lit("Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36"));
+}
+
+int main(int argc, char *argv[]) {
+    u32 iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    Arena *arena = arena_make(1 * MB);
+    Buffer_Pool pool = {0};
+    Parser parser = {0};
+    Request request;
+
+    u32 request_size = sizeof(bench_request) - 1;
+
+    u64 allocated = parse_in_chunks(arena, &pool, &parser, &request, request_size);
+    if (!request_is_valid(&parser, &request)) {
+        printf("el request no se parseo bien\n");
+        return 1;
+    }
+
+    f64 start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        parse_in_chunks(arena, &pool, &parser, &request, request_size);
+    }
+    f64 elapsed = now_seconds() - start;
+
+    printf("request:                 %d bytes\n", request_size);
+    printf("bytes pedidos a la arena: %lu por request\n", allocated);
+    printf("tiempo:                  %.1f ns por request (%.2f ns por byte)\n",
+           elapsed * 1e9 / iterations, elapsed * 1e9 / iterations / request_size);
+
+    u32 failed_chunks = 0;
+    for (u32 chunk_size = 1; chunk_size <= 64; chunk_size++) {
+        parse_in_chunks(arena, &pool, &parser, &request, chunk_size);
+        if (!request_is_valid(&parser, &request)) {
+            failed_chunks++;
+        }
+    }
+    printf("partido en chunks de 1 a 64 bytes: %s (%d fallaron)\n",
+           failed_chunks == 0 ? "ok" : "ERROR", failed_chunks);
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * HTTP/1.1 pipelining: requests por segundo y writes por request segun
+ * cuantos requests manda cada conexion juntos (1, 4, 16 y 64).
+ *
+ * Uso: ./build.sh exp pipelining [segundos por corrida] [conexiones]
+ *
+ * Cada conexion es keep-alive, manda `depth` requests en un solo write y
+ * espera todas las respuestas antes de mandar los siguientes. Con epoll se
+ * cuentan los writev del server: si las respuestas de un read salen juntas
+ * tendrian que ser bastante menos que uno por request.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+
+#include <sys/wait.h>
+#include <time.h>
+
+static u64 *server_writes;
+
+#define writev(...) (__atomic_fetch_add(server_writes, 1, __ATOMIC_RELAXED), writev(__VA_ARGS__))
+
+#include "../http.c"
+
+#undef writev
+
+#define BENCH_PORT 8893
+#define MAX_CLIENTS 256
+#define MAX_DEPTH 64
+
+static volatile bool bench_running = true;
+static u32 bench_depth = 1;
+// un puerto por corrida: el socket de un server con io_uring puede tardar en liberarse
+static u16 bench_port = BENCH_PORT;
+
+typedef struct {
+    u64 requests;
+} Bench_Client;
+
+static void handle_ok(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"ok", 2);
+}
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *client_run(void *data) {
+    Bench_Client *client = (Bench_Client *)data;
+
+    static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+    static const char response_end[] = "\r\n\r\nok";
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(bench_port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    char batch[MAX_DEPTH * sizeof(request)];
+    u32 batch_size = 0;
+    for (u32 i = 0; i < bench_depth; i++) {
+        memcpy(batch + batch_size, request, sizeof(request) - 1);
+        batch_size += sizeof(request) - 1;
+    }
+
+    while (bench_running) {
+        if (write(fd, batch, batch_size) != batch_size) {
+            break;
+        }
+
+        // contar respuestas buscando el final de cada una
+        u32 responses = 0;
+        u32 matched = 0;
+        char buffer[16 * KB];
+
+        while (responses < bench_depth) {
+            i32 n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                close(fd);
+                return NULL;
+            }
+
+            for (i32 i = 0; i < n; i++) {
+                if (buffer[i] == response_end[matched]) {
+                    matched++;
+                    if (matched == sizeof(response_end) - 1) {
+                        responses++;
+                        matched = 0;
+                    }
+                } else {
+                    matched = buffer[i] == response_end[0] ? 1 : 0;
+                }
+            }
+        }
+
+        client->requests += responses;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static pid_t server_spawn(Events_Backend backend) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(1 * MB);
+        Server *server = http_server_make(arena);
+        http_server_set_backend(server, backend);
+        http_server_handle(server, "GET /", &handle_ok);
+        exit(http_server_start(server, bench_port, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+static void bench_depth_run(char *name, Events_Backend backend, f64 duration, u32 clients_count) {
+    bench_port++;
+    pid_t pid = server_spawn(backend);
+
+    Bench_Client clients[MAX_CLIENTS] = {0};
+    pthread_t threads[MAX_CLIENTS];
+
+    bench_running = true;
+
+    for (u32 i = 0; i < clients_count; i++) {
+        pthread_create(&threads[i], NULL, &client_run, &clients[i]);
+    }
+
+    // no contar el arranque de las conexiones
+    usleep(100 * 1000);
+    u64 requests_start = 0;
+    for (u32 i = 0; i < clients_count; i++) {
+        requests_start += clients[i].requests;
+    }
+    u64 writes_start = __atomic_load_n(server_writes, __ATOMIC_RELAXED);
+    f64 start = now_seconds();
+
+    usleep((useconds_t)(duration * 1e6));
+
+    u64 requests_end = 0;
+    for (u32 i = 0; i < clients_count; i++) {
+        requests_end += clients[i].requests;
+    }
+    u64 writes_end = __atomic_load_n(server_writes, __ATOMIC_RELAXED);
+    f64 elapsed = now_seconds() - start;
+
+    bench_running = false;
+    for (u32 i = 0; i < clients_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    u64 requests = requests_end - requests_start;
+    u64 writes = writes_end - writes_start;
+
+    if (backend == EVENTS_BACKEND_EPOLL) {
+        printf("%6d %10s %12.0f %14.3f\n", bench_depth, name, requests / elapsed,
+               requests > 0 ? (f64)writes / requests : 0.0);
+    } else {
+        printf("%6d %10s %12.0f %14s\n", bench_depth, name, requests / elapsed, "-");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    f64 duration = argc > 1 ? atof(argv[1]) : 2.0;
+    u32 clients_count = argc > 2 ? atoi(argv[2]) : 32;
+
+    clients_count = clients_count > MAX_CLIENTS ? MAX_CLIENTS : clients_count;
+
+    server_writes = mmap(0, sizeof(u64), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("conexiones: %d, %.1fs por corrida\n", clients_count, duration);
+    printf("%6s %10s %12s %14s\n", "depth", "backend", "req/s", "writev/req");
+
+    u32 depths[] = { 1, 4, 16, MAX_DEPTH };
+
+    for (u32 i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        bench_depth = depths[i];
+        bench_depth_run("epoll", EVENTS_BACKEND_EPOLL, duration, clients_count);
+        bench_depth_run("io_uring", EVENTS_BACKEND_IO_URING, duration, clients_count);
+    }
+
+    return 0;
+}
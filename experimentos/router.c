@@ -0,0 +1,260 @@
+/*
+ * Costo de buscar la ruta de un request segun cuantas rutas tiene el server.
+ *
+ * Uso: ./build.sh exp router [iteraciones]
+ *
+ * Las rutas son como las de una API: por cada recurso un listado, un
+ * elemento por id, sus items y un item puntual. Los requests pegan en cada
+ * tipo de ruta y algunos no matchean nada. Los URIs se parsean una vez
+ * antes de medir, asi el numero es solo el del router. Los requests a rutas
+ * sin params se miden tambien aparte, con la tabla de las estaticas y
+ * recorriendo el trie como si no estuviera.
+ *
+ * Despues mide lo que le cuesta a un handler leer los cuatro params de una
+ * ruta por nombre, por slot y por id, y lo que cuesta llegar a un {*path}
+ * despues de probar sin suerte un literal y un param.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#define ROUTES_PER_RESOURCE 4
+#define BENCH_REQUESTS_COUNT 256
+
+static const char *resource_names[] = {
+    "users", "orders", "products", "invoices", "sessions", "carts", "reviews", "shipments",
+    "payments", "accounts", "teams", "projects", "tickets", "comments", "files", "events",
+};
+
+static void handle_nothing(Request *request, Response *response) {
+}
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *resource_name(Arena *arena, u32 resource) {
+    u32 names_count = sizeof(resource_names) / sizeof(resource_names[0]);
+
+    char *name = arena_alloc(arena, 32);
+    snprintf(name, 32, "%s%d", resource_names[resource % names_count], resource / names_count);
+    return name;
+}
+
+static Server *server_with_routes(Arena *arena, u32 routes_count) {
+    Server *server = http_server_make(arena);
+
+    for (u32 resource = 0; resource * ROUTES_PER_RESOURCE < routes_count; resource++) {
+        char *name = resource_name(arena, resource);
+
+        char *patterns[ROUTES_PER_RESOURCE] = {
+            "GET /api/v1/%s",
+            "GET /api/v1/%s/{id}",
+            "GET /api/v1/%s/{id}/items",
+            "GET /api/v1/%s/{id}/items/{item}",
+        };
+
+        for (u32 i = 0; i < ROUTES_PER_RESOURCE; i++) {
+            char *pattern = arena_alloc(arena, 128);
+            snprintf(pattern, 128, patterns[i], name);
+            http_server_handle(server, pattern, &handle_nothing);
+        }
+    }
+
+    server_freeze_routes(server);
+
+    return server;
+}
+
+static void requests_for_routes(Arena *arena, Request *requests, u32 routes_count) {
+    u32 resources_count = routes_count / ROUTES_PER_RESOURCE;
+
+    for (u32 i = 0; i < BENCH_REQUESTS_COUNT; i++) {
+        char *name = resource_name(arena, (i * 7919) % resources_count);
+
+        char *uri = arena_alloc(arena, 128);
+        switch (i % 5) {
+            case 0: snprintf(uri, 128, "/api/v1/%s", name); break;
+            case 1: snprintf(uri, 128, "/api/v1/%s/%d", name, i); break;
+            case 2: snprintf(uri, 128, "/api/v1/%s/%d/items", name, i); break;
+            case 3: snprintf(uri, 128, "/api/v1/%s/%d/items/%d", name, i, i * 3); break;
+            case 4: snprintf(uri, 128, "/api/v1/%s/%d/history", name, i); break; // no existe
+        }
+
+        request_init(&requests[i]);
+        requests[i].method = HTTP_METHOD_GET;
+        request_set_uri(&requests[i], arena, string(uri));
+    }
+}
+
+static void bench_routes(u32 routes_count, u32 iterations) {
+    Arena *arena = arena_make(16 * MB);
+
+    Server *server = server_with_routes(arena, routes_count);
+
+    Request *requests = arena_alloc(arena, sizeof(Request) * BENCH_REQUESTS_COUNT);
+    requests_for_routes(arena, requests, routes_count);
+
+    u32 found = 0;
+    for (u32 i = 0; i < BENCH_REQUESTS_COUNT; i++) {
+        found += server_find_route(server, &requests[i]) != NULL;
+    }
+
+    volatile u64 sink = 0;
+
+    f64 start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        sink += (u64)server_find_route(server, &requests[i % BENCH_REQUESTS_COUNT]);
+    }
+    f64 lookup_ns = (now_seconds() - start) * 1e9 / iterations;
+
+    // los requests % 5 == 0 son los de las rutas sin params
+    u32 static_count = (BENCH_REQUESTS_COUNT + 4) / 5;
+
+    start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        sink += (u64)server_find_route(server, &requests[(i % static_count) * 5]);
+    }
+    f64 static_ns = (now_seconds() - start) * 1e9 / iterations;
+
+    start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        Request *request = &requests[(i % static_count) * 5];
+        request->path_params_count = 0;
+        sink += (u64)router_match(&server->routers[request->method], 0, request, 1);
+    }
+    f64 static_trie_ns = (now_seconds() - start) * 1e9 / iterations;
+
+    if (sink != 1) {
+        printf("%8d %10d/%d %14.1f %16.1f %16.1f\n", routes_count, found, BENCH_REQUESTS_COUNT,
+               lookup_ns, static_ns, static_trie_ns);
+    }
+
+    arena_destroy(arena);
+}
+
+static void bench_path_params(u32 iterations) {
+    Arena *arena = arena_make(1 * MB);
+
+    Server *server = http_server_make(arena);
+    http_server_handle(server, "GET /orgs/{org}/teams/{team}/members/{member}/keys/{key}", &handle_nothing);
+
+    u32 ids[4] = {
+        http_server_path_param_id(server, "org"),
+        http_server_path_param_id(server, "team"),
+        http_server_path_param_id(server, "member"),
+        http_server_path_param_id(server, "key"),
+    };
+    String names[4] = {string_lit("org"), string_lit("team"), string_lit("member"), string_lit("key")};
+
+    server_freeze_routes(server);
+
+    Request request;
+    request_init(&request);
+    request.method = HTTP_METHOD_GET;
+    request_set_uri(&request, arena, string_lit("/orgs/acme/teams/platform/members/ana/keys/k-123"));
+
+    if (server_find_route(server, &request) == NULL ||
+            !string_eq(http_request_get_path_param_by_id(&request, ids[2]), string_lit("ana"))) {
+        printf("la ruta con params no matcheo\n");
+        return;
+    }
+
+    volatile u64 sink = 0;
+
+    f64 start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        for (u32 p = 0; p < 4; p++) {
+            sink += http_request_get_path_param(&request, names[p]).size;
+        }
+    }
+    f64 name_ns = (now_seconds() - start) * 1e9 / iterations;
+
+    start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        for (u32 p = 0; p < 4; p++) {
+            sink += http_request_get_path_param_at(&request, p).size;
+        }
+    }
+    f64 slot_ns = (now_seconds() - start) * 1e9 / iterations;
+
+    start = now_seconds();
+    for (u32 i = 0; i < iterations; i++) {
+        for (u32 p = 0; p < 4; p++) {
+            sink += http_request_get_path_param_by_id(&request, ids[p]).size;
+        }
+    }
+    f64 id_ns = (now_seconds() - start) * 1e9 / iterations;
+
+    if (sink != 1) {
+        printf("\n%8s %13s %11s %11s\n", "params", "nombre (ns)", "slot (ns)", "id (ns)");
+        printf("%8d %13.1f %11.1f %11.1f\n", 4, name_ns, slot_ns, id_ns);
+    }
+
+    arena_destroy(arena);
+}
+
+static void bench_catch_all(u32 iterations) {
+    Arena *arena = arena_make(1 * MB);
+
+    Server *server = http_server_make(arena);
+    http_server_handle(server, "GET /assets/app-js", &handle_nothing);
+    http_server_handle(server, "GET /assets/{dir}/index", &handle_nothing);
+    http_server_handle(server, "GET /assets/{*path}", &handle_nothing);
+    server_freeze_routes(server);
+
+    char *uris[] = {
+        "/assets/app-js",
+        "/assets/css/index",
+        "/assets/css/themes/dark/main.css",
+    };
+    char *kinds[] = {"estatica", "param", "catch-all"};
+
+    printf("\n%10s %12s %14s\n", "ruta", "resto", "busqueda (ns)");
+
+    for (u32 u = 0; u < 3; u++) {
+        Request request;
+        request_init(&request);
+        request.method = HTTP_METHOD_GET;
+        request_set_uri(&request, arena, string(uris[u]));
+
+        if (server_find_route(server, &request) == NULL) {
+            printf("%s no matcheo\n", uris[u]);
+            continue;
+        }
+        String rest = http_request_get_path_param_at(&request, request.path_params_count - 1);
+
+        volatile u64 sink = 0;
+
+        f64 start = now_seconds();
+        for (u32 i = 0; i < iterations; i++) {
+            sink += (u64)server_find_route(server, &request);
+        }
+        f64 lookup_ns = (now_seconds() - start) * 1e9 / iterations;
+
+        if (sink != 1) {
+            printf("%10s %12.*s %14.1f\n", kinds[u], rest.size > 12 ? 12 : rest.size, rest.data, lookup_ns);
+        }
+    }
+
+    arena_destroy(arena);
+}
+
+int main(int argc, char *argv[]) {
+    u32 iterations = argc > 1 ? atoi(argv[1]) : 2000000;
+
+    printf("%8s %13s %14s %16s %16s\n", "rutas", "encontradas", "busqueda (ns)", "estaticas (ns)", "sin tabla (ns)");
+
+    bench_routes(10, iterations);
+    bench_routes(100, iterations);
+    bench_routes(1000, iterations);
+
+    bench_path_params(iterations);
+    bench_catch_all(iterations);
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Costo del timer wheel con muchas conexiones.
+ *
+ * Uso: ./build.sh exp timers [conexiones] [requests]
+ *
+ * No usa sockets: arma un worker con N conexiones en el wheel y mide por
+ * separado lo que se agrega en el camino de cada request (renovar el
+ * timeout) y lo que cuesta avanzar el wheel un tick.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u32 random_u32(u32 *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int main(int argc, char *argv[]) {
+    u32 connections_count = argc > 1 ? atoi(argv[1]) : 100000;
+    u32 requests_count = argc > 2 ? atoi(argv[2]) : 10000000;
+
+    Arena *arena = arena_make(1 * MB);
+    Server *server = http_server_make(arena);
+
+    Worker worker = {0};
+    worker.server = server;
+    timer_wheel_init(&worker.timers);
+
+    Connection *connections = calloc(connections_count, sizeof(Connection));
+    struct sockaddr_in address = {0};
+
+    for (u32 i = 0; i < connections_count; i++) {
+        connection_init(&connections[i], -1, address);
+        worker_update_timeout(&worker, &connections[i]);
+    }
+
+    // lo que hace cada request keep-alive: termina (timeout_kind = NONE) y
+    // la conexion vuelve a quedar ociosa con un deadline nuevo
+    u32 seed = 2463534242;
+    f64 start = now_seconds();
+    for (u32 i = 0; i < requests_count; i++) {
+        Connection *connection = &connections[random_u32(&seed) % connections_count];
+        connection->timeout_kind = TIMEOUT_KIND_NONE;
+        worker_update_timeout(&worker, connection);
+    }
+    f64 with_timers = now_seconds() - start;
+
+    // el mismo recorrido sin tocar el wheel
+    seed = 2463534242;
+    start = now_seconds();
+    for (u32 i = 0; i < requests_count; i++) {
+        Connection *connection = &connections[random_u32(&seed) % connections_count];
+        connection->timeout_kind = TIMEOUT_KIND_NONE;
+        __asm__ volatile("" : : "r"(connection) : "memory");
+    }
+    f64 without_timers = now_seconds() - start;
+
+    // una vuelta entera del wheel, corriendo el reloj a mano
+    u32 ticks = TIMER_WHEEL_SLOTS;
+    start = now_seconds();
+    for (u32 i = 0; i < ticks; i++) {
+        worker.timers.start_ms -= TIMER_WHEEL_TICK_MS;
+        worker_expire_timers(&worker);
+    }
+    f64 wheel_turn = now_seconds() - start;
+
+    printf("conexiones en el wheel:     %d\n", worker.timers.timers_count);
+    printf("sizeof(Connection):         %zu bytes\n", sizeof(Connection));
+    printf("renovar timeout por request: %.2f ns (sin wheel: %.2f ns)\n",
+           with_timers * 1e9 / requests_count, without_timers * 1e9 / requests_count);
+    printf("avanzar un tick:             %.2f us (%d ticks por segundo)\n",
+           wheel_turn * 1e6 / ticks, 1000 / TIMER_WHEEL_TICK_MS);
+    printf("por conexion por segundo:    %.2f ns\n",
+           wheel_turn * 1e9 / ticks * (1000 / TIMER_WHEEL_TICK_MS) / connections_count);
+
+    return 0;
+}
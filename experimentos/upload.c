@@ -0,0 +1,292 @@
+/*
+ * Uploads grandes con body en streaming: throughput y memoria del server
+ * segun el tamanio del body.
+ *
+ * Uso: ./build.sh exp upload [MB del upload mas grande]
+ *
+ * Sube bodies de 1 MB hasta el maximo por una conexion keep-alive a una
+ * ruta de http_server_handle_stream, que solo suma los bytes. Despues de
+ * cada upload se mira el VmRSS del server: tendria que quedar igual sin
+ * importar el Content-Length. Cada tamanio se sube dos veces: con
+ * Content-Length y con Transfer-Encoding: chunked, de a chunks de 64 KB.
+ * Al final manda un body de mas de
+ * MAX_BODY_SIZE a una ruta sin streaming, que tiene que contestar 413.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#include <sys/wait.h>
+
+#define BENCH_PORT 8894
+#define UPLOAD_CHUNK_SIZE (64 * KB)
+
+static u16 bench_port = BENCH_PORT;
+
+typedef struct {
+    u64 size;
+    u64 checksum;
+} Upload;
+
+static void handle_upload_data(Request *request, u8 *data, size_t size) {
+    Upload *upload = request->user_data;
+    if (upload == NULL) {
+        upload = calloc(1, sizeof(Upload));
+        request->user_data = upload;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        upload->checksum += data[i];
+    }
+    upload->size += size;
+}
+
+static void handle_upload(Request *request, Response *response) {
+    Upload *upload = request->user_data;
+
+    // http_response_write no copia, la respuesta se codifica despues del handler
+    static char text[64];
+    i32 size = snprintf(text, sizeof(text), "%lu %lu", upload->size, upload->checksum);
+    http_response_write(response, (u8 *)text, size);
+
+    free(upload);
+}
+
+static void handle_small(Request *request, Response *response) {
+    http_response_write(response, request->body.data, request->body.size);
+}
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64 process_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    u64 rss = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmRSS: %lu kB", &rss) == 1) {
+            break;
+        }
+    }
+
+    fclose(file);
+    return rss;
+}
+
+static pid_t server_spawn(Events_Backend backend) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(1 * MB);
+        Server *server = http_server_make(arena);
+        http_server_set_backend(server, backend);
+        http_server_set_workers(server, 1);
+        http_server_handle_stream(server, "POST /upload", &handle_upload_data, &handle_upload, HANDLER_FLAG_NONE);
+        http_server_handle(server, "POST /small", &handle_small);
+        exit(http_server_start(server, bench_port, "127.0.0.1"));
+    }
+
+    usleep(200 * 1000);
+    return pid;
+}
+
+static i32 client_connect(void) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(bench_port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool write_all(i32 fd, u8 *data, u64 size) {
+    while (size > 0) {
+        i64 written = write(fd, data, size);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/*
+ * Lee una respuesta entera (headers y body con Content-Length) y deja el
+ * body en body, terminado en 0.
+ */
+static bool read_response(i32 fd, u32 *status, char *body, u32 body_capacity) {
+    char buffer[4 * KB];
+    u32 used = 0;
+
+    while (true) {
+        i64 n = read(fd, buffer + used, sizeof(buffer) - used - 1);
+        if (n <= 0) {
+            return false;
+        }
+        used += n;
+        buffer[used] = 0;
+
+        char *headers_end = strstr(buffer, "\r\n\r\n");
+        if (headers_end == NULL) {
+            continue;
+        }
+
+        char *content_length = strcasestr(buffer, "content-length: ");
+        u32 body_size = content_length ? atoi(content_length + 16) : 0;
+        char *body_start = headers_end + 4;
+
+        if ((u32)(buffer + used - body_start) < body_size) {
+            continue;
+        }
+
+        *status = atoi(buffer + 9);
+        body_size = body_size < body_capacity - 1 ? body_size : body_capacity - 1;
+        memcpy(body, body_start, body_size);
+        body[body_size] = 0;
+        return true;
+    }
+}
+
+static bool upload(i32 fd, u64 size, bool chunked, f64 *elapsed) {
+    static u8 chunk[UPLOAD_CHUNK_SIZE];
+    for (u32 i = 0; i < UPLOAD_CHUNK_SIZE; i++) {
+        chunk[i] = (u8)(i * 31);
+    }
+
+    char head[256];
+    i32 head_size;
+    if (chunked) {
+        head_size = snprintf(head, sizeof(head),
+                             "POST /upload HTTP/1.1\r\nHost: bench\r\nTransfer-Encoding: chunked\r\n\r\n");
+    } else {
+        head_size = snprintf(head, sizeof(head),
+                             "POST /upload HTTP/1.1\r\nHost: bench\r\nContent-Length: %lu\r\n\r\n", size);
+    }
+
+    f64 start = now_seconds();
+
+    if (!write_all(fd, (u8 *)head, head_size)) {
+        return false;
+    }
+
+    u64 expected_checksum = 0;
+    for (u64 sent = 0; sent < size;) {
+        u64 chunk_size = size - sent < UPLOAD_CHUNK_SIZE ? size - sent : UPLOAD_CHUNK_SIZE;
+
+        char chunk_head[32];
+        i32 chunk_head_size = snprintf(chunk_head, sizeof(chunk_head), "%lx\r\n", chunk_size);
+        if (chunked && !write_all(fd, (u8 *)chunk_head, chunk_head_size)) {
+            return false;
+        }
+
+        if (!write_all(fd, chunk, chunk_size)) {
+            return false;
+        }
+
+        if (chunked && !write_all(fd, (u8 *)"\r\n", 2)) {
+            return false;
+        }
+        for (u64 i = 0; i < chunk_size; i++) {
+            expected_checksum += chunk[i];
+        }
+        sent += chunk_size;
+    }
+
+    if (chunked && !write_all(fd, (u8 *)"0\r\n\r\n", 5)) {
+        return false;
+    }
+
+    u32 status;
+    char body[128];
+    if (!read_response(fd, &status, body, sizeof(body))) {
+        return false;
+    }
+
+    *elapsed = now_seconds() - start;
+
+    u64 received_size = 0;
+    u64 received_checksum = 0;
+    sscanf(body, "%lu %lu", &received_size, &received_checksum);
+
+    return status == 200 && received_size == size && received_checksum == expected_checksum;
+}
+
+static void bench_backend(char *name, Events_Backend backend, u32 max_mb) {
+    bench_port++;
+    pid_t pid = server_spawn(backend);
+
+    printf("%s (RSS del server al arrancar: %lu KB)\n", name, process_rss_kb(pid));
+    printf("%10s %10s %12s %14s %8s\n", "MB", "framing", "MB/s", "RSS (KB)", "ok");
+
+    i32 fd = client_connect();
+    if (fd == -1) {
+        printf("no se pudo conectar\n");
+        kill(pid, SIGINT);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    bool ok = true;
+    for (u32 mb = 1; mb <= max_mb && ok; mb *= 4) {
+        for (u32 chunked = 0; chunked <= 1 && ok; chunked++) {
+            f64 elapsed = 0;
+            ok = upload(fd, (u64)mb * MB, chunked, &elapsed);
+
+            printf("%10d %10s %12.0f %14lu %8s\n", mb, chunked ? "chunked" : "length",
+                   ok ? mb / elapsed : 0.0, process_rss_kb(pid), ok ? "si" : "NO");
+        }
+    }
+
+    close(fd);
+
+    // sin streaming el body no puede pasar de MAX_BODY_SIZE
+    fd = client_connect();
+    char request[256];
+    i32 request_size = snprintf(request, sizeof(request),
+                                "POST /small HTTP/1.1\r\nHost: bench\r\nContent-Length: %d\r\n"
+                                "Expect: 100-continue\r\n\r\n", 64 * KB);
+    u32 status = 0;
+    char body[128];
+    if (fd != -1 && write_all(fd, (u8 *)request, request_size)) {
+        read_response(fd, &status, body, sizeof(body));
+    }
+    printf("body de 64 KB sin streaming: %d (%s)\n\n", status, status == 413 ? "ok" : "ERROR");
+    close(fd);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+    u32 max_mb = argc > 1 ? atoi(argv[1]) : 256;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_backend("epoll", EVENTS_BACKEND_EPOLL, max_mb);
+    bench_backend("io_uring", EVENTS_BACKEND_IO_URING, max_mb);
+
+    return 0;
+}
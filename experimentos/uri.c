@@ -0,0 +1,107 @@
+/*
+ * Validacion y decodificacion del URI: costo de la pasada con SSE4.2 contra
+ * la tabla de a un byte, y de pedir los query params ya decodificados.
+ *
+ * Uso: ./build.sh exp uri [iteraciones]
+ *
+ * Los URIs son como los que mandan los clientes: un search con el query
+ * en %XX y '+', un callback de OAuth y uno sin escapes. Primero verifica
+ * que los params salgan decodificados, despues mide.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+static const char *bench_uris[] = {
+    "/search?q=caf%C3%A9+con+leche&category=bebidas%2Fcalientes&sort=price_asc&page=3&utm_source=newsletter&utm_campaign=oto%C3%B1o-2024",
+    "/oauth/callback?code=4%2F0AeaYSHB-x8Gd~zQ1r7kX_tQ&state=eyJyZXR1cm4iOiIvY2FydCJ9&scope=email%20profile%20openid",
+    "/api/v2/users/42/orders/2024-05-17/items?include=product,seller&fields=id,name,price",
+};
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool request_from_uri(Arena *arena, Request *request, const char *uri) {
+    arena_reset(arena);
+    request_init(request);
+    request->method = HTTP_METHOD_GET;
+
+    return request_set_uri(request, arena, string(uri));
+}
+
+static bool check_decoded(Arena *arena) {
+    Request request;
+
+    // los valores decodificados viven en la arena: se miran antes de reusarla
+    request_from_uri(arena, &request, bench_uris[0]);
+    bool search_ok =
+        string_eq(http_request_get_query_param(&request, string_lit("q")), string_lit("caf\xC3\xA9 con leche")) &&
+        string_eq(http_request_get_query_param(&request, string_lit("category")), string_lit("bebidas/calientes"));
+
+    request_from_uri(arena, &request, bench_uris[1]);
+    bool oauth_ok =
+        string_eq(http_request_get_query_param(&request, string_lit("code")), string_lit("4/0AeaYSHB-x8Gd~zQ1r7kX_tQ")) &&
+        string_eq(http_request_get_query_param(&request, string_lit("scope")), string_lit("email profile openid"));
+
+    return search_ok && oauth_ok;
+}
+
+int main(int argc, char *argv[]) {
+    u32 iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    u32 uris_count = sizeof(bench_uris) / sizeof(bench_uris[0]);
+
+    Arena *arena = arena_make(1 * MB);
+
+    if (!check_decoded(arena)) {
+        printf("los query params no se decodificaron bien\n");
+        return 1;
+    }
+    printf("decodificacion: ok\n\n");
+
+    printf("%10s %16s %16s %16s\n", "bytes", "tabla (ns)", "sse4.2 (ns)", "params (ns)");
+
+    for (u32 u = 0; u < uris_count; u++) {
+        u32 size = strlen(bench_uris[u]);
+
+        Parser_Buffer buffer = {
+            .data = (u8 *)bench_uris[u],
+            .size = size,
+            .used = size,
+        };
+
+        volatile u32 sink = 0;
+
+        f64 start = now_seconds();
+        for (u32 i = 0; i < iterations; i++) {
+            sink += parser_skip_class(&buffer, 0, size, CHAR_CLASS_URI);
+        }
+        f64 table_ns = (now_seconds() - start) * 1e9 / iterations;
+
+        start = now_seconds();
+        for (u32 i = 0; i < iterations; i++) {
+            sink += parser_skip_uri_chars(&buffer, 0, size);
+        }
+        f64 simd_ns = (now_seconds() - start) * 1e9 / iterations;
+
+        // armar el path y los params, y pedir dos ya decodificados
+        Request request;
+        start = now_seconds();
+        for (u32 i = 0; i < iterations; i++) {
+            request_from_uri(arena, &request, bench_uris[u]);
+            sink += http_request_get_query_param(&request, string_lit("q")).size;
+            sink += http_request_get_query_param(&request, string_lit("scope")).size;
+        }
+        f64 params_ns = (now_seconds() - start) * 1e9 / iterations;
+
+        if (sink != (u32)-1) {
+            printf("%10d %16.1f %16.1f %16.1f\n", size, table_ns, simd_ns, params_ns);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Throughput del server variando la cantidad de workers (1..N cores).
+ *
+ * Uso: ./build.sh exp workers [segundos por corrida] [threads cliente] [max workers] [lt|et|et-shared]
+ *
+ * et:        epoll edge-triggered
+ * et-shared: edge-triggered con un unico socket de escucha (EPOLLEXCLUSIVE)
+ *
+ * Por cada cantidad de workers se levanta el server en un proceso hijo y
+ * desde este proceso se le pegan requests con varios threads. Cada request
+ * abre su propia conexion, asi el accept tambien se reparte entre workers.
+ */
+#define _GNU_SOURCE
+
+#include "../gg_stdlib.h"
+#include "../http.h"
+#include "../http.c"
+
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_PORT 8890
+
+static volatile bool bench_running = true;
+static bool bench_edge_triggered = false;
+static bool bench_shared_listener = false;
+
+typedef struct {
+    u64 requests;
+} Bench_Client;
+
+static void handle_ok(Request *request, Response *response) {
+    http_response_write(response, (u8 *)"ok", 2);
+}
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool client_request(struct sockaddr_in *address) {
+    static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+
+    // RST al cerrar: evita llenar el cliente de sockets en TIME_WAIT
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+    bool ok = false;
+
+    if (connect(fd, (struct sockaddr *)address, sizeof(*address)) == 0 &&
+        write(fd, request, sizeof(request) - 1) == sizeof(request) - 1) {
+
+        char response[512];
+        u32 received = 0;
+
+        while (received < sizeof(response)) {
+            i32 n = read(fd, response + received, sizeof(response) - received);
+            if (n <= 0) {
+                break;
+            }
+            received += n;
+
+            String str = string_with_len(response, received);
+            if (str.size >= 2 && str.data[str.size - 2] == 'o' && str.data[str.size - 1] == 'k') {
+                ok = true;
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+static void *client_run(void *data) {
+    Bench_Client *client = (Bench_Client *)data;
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(BENCH_PORT),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    while (bench_running) {
+        if (client_request(&address)) {
+            client->requests++;
+        }
+    }
+
+    return NULL;
+}
+
+static pid_t server_spawn(u32 workers_count) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+
+        Arena *arena = arena_make(8 * MB);
+        Server *server = http_server_make(arena);
+        http_server_set_workers(server, workers_count);
+        http_server_set_edge_triggered(server, bench_edge_triggered);
+        http_server_set_reuse_port(server, !bench_shared_listener);
+        http_server_handle(server, "GET /", &handle_ok);
+        exit(http_server_start(server, BENCH_PORT, "127.0.0.1"));
+    }
+
+    // esperar a que el server este escuchando
+    usleep(200 * 1000);
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    f64 duration = argc > 1 ? atof(argv[1]) : 2.0;
+    i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 clients_count = argc > 2 ? atoi(argv[2]) : (u32)cores * 2;
+    u32 max_workers = argc > 3 ? atoi(argv[3]) : (u32)cores;
+    char *mode = argc > 4 ? argv[4] : "lt";
+
+    bench_edge_triggered = cstr_eq(mode, "et") || cstr_eq(mode, "et-shared");
+    bench_shared_listener = cstr_eq(mode, "et-shared");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("cores: %ld, threads cliente: %d, %.1fs por corrida, modo: %s\n", cores, clients_count, duration, mode);
+    printf("%8s %12s %10s\n", "workers", "req/s", "speedup");
+
+    f64 baseline = 0;
+
+    for (u32 workers_count = 1; workers_count <= max_workers; workers_count++) {
+        pid_t pid = server_spawn(workers_count);
+
+        Bench_Client clients[256] = {0};
+        pthread_t threads[256];
+        clients_count = clients_count > 256 ? 256 : clients_count;
+
+        bench_running = true;
+        f64 start = now_seconds();
+
+        for (u32 i = 0; i < clients_count; i++) {
+            pthread_create(&threads[i], NULL, &client_run, &clients[i]);
+        }
+
+        usleep((useconds_t)(duration * 1e6));
+        bench_running = false;
+
+        u64 total = 0;
+        for (u32 i = 0; i < clients_count; i++) {
+            pthread_join(threads[i], NULL);
+            total += clients[i].requests;
+        }
+
+        f64 elapsed = now_seconds() - start;
+        f64 throughput = total / elapsed;
+        if (workers_count == 1) {
+            baseline = throughput;
+        }
+
+        printf("%8d %12.0f %9.2fx\n", workers_count, throughput, throughput / baseline);
+
+        kill(pid, SIGINT);
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
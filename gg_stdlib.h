@@ -6,6 +6,7 @@
 #include <math.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -165,6 +166,12 @@ struct Arena {
     u8  *data;
     u64 size;
     u64 capacity;
+
+    // Hasta donde se toco la memoria desde el ultimo decommit. Las paginas
+    // por debajo pueden estar residentes, las de arriba seguro que no.
+    u64 committed;
+    // arena_reset le devuelve al sistema lo que este por encima. 0 nunca.
+    u64 decommit_above;
 };
 
 struct Arena_Temp {
@@ -179,6 +186,7 @@ void arena_init(Arena *arena, u8 *data, u64 capacity);
 void *arena_alloc(Arena *arena, u64 size);
 void *arena_alloc_aligned(Arena *arena, u64 size, size_t align);
 void arena_reset(Arena *arena);
+void arena_set_decommit_above(Arena *arena, u64 bytes);
 void arena_destroy(Arena *arena);
 
 Arena_Temp arena_temp_begin(Arena *arena);
@@ -187,8 +195,17 @@ void arena_temp_end(Arena_Temp arena_temp);
 Arena_Temp get_scratch(Arena **conflicts, u64 conflict_count);
 #define release_scratch(t) arena_temp_end(t)
 
+/*
+ * Reserva capacity de espacio de direcciones. Las paginas se piden al
+ * sistema recien cuando se tocan, asi que una arena grande que casi no se
+ * usa ocupa solo lo que se uso.
+ */
 Arena *arena_make(u64 capacity) {
-    void *memory = mmap(0, sizeof(Arena) + capacity, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    i32 flags = MAP_PRIVATE|MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *memory = mmap(0, sizeof(Arena) + capacity, PROT_READ|PROT_WRITE, flags, -1, 0);
     if (memory == (void *)-1) {
         panic_with_msg("mmap failed");
     }
@@ -197,6 +214,8 @@ Arena *arena_make(u64 capacity) {
     arena->data = memory + sizeof(Arena);
     arena->capacity = capacity;
     arena->size = 0;
+    arena->committed = 0;
+    arena->decommit_above = 0;
 
     return arena;
 }
@@ -240,6 +259,9 @@ void *arena_alloc_aligned(Arena *arena, u64 size, size_t align) {
 
     void *result = &arena->data[offset];
     arena->size = offset + size;
+    if (arena->size > arena->committed) {
+        arena->committed = arena->size;
+    }
 
     memset(result, 0, size);
 
@@ -248,6 +270,30 @@ void *arena_alloc_aligned(Arena *arena, u64 size, size_t align) {
 
 void arena_reset(Arena *arena) {
     arena->size = 0;
+
+    if (arena->decommit_above == 0 || arena->committed <= arena->decommit_above) {
+        return;
+    }
+
+    // MADV_DONTNEED libera las paginas y la proxima vez que se tocan vuelven
+    // en cero. Solo paginas enteras: la que contiene decommit_above queda.
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t from = align_forward((uintptr_t)arena->data + arena->decommit_above, page_size);
+    uintptr_t to = align_forward((uintptr_t)arena->data + arena->committed, page_size);
+
+    if (to > from) {
+        madvise((void *)from, to - from, MADV_DONTNEED);
+    }
+
+    arena->committed = arena->decommit_above;
+}
+
+/*
+ * Cuanto de la arena se queda residente entre usos. Lo que un uso grande
+ * toque por encima de esto vuelve al sistema en el proximo arena_reset.
+ */
+void arena_set_decommit_above(Arena *arena, u64 bytes) {
+    arena->decommit_above = bytes;
 }
 
 void arena_destroy(Arena *arena) {
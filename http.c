@@ -1,44 +1,154 @@
 static i32 signals_init(void);
 static void signal_handler(i32 signal_number);
-static i32 start_listening(u32 port, char *host);
+static i32 start_listening(u32 port, char *host, bool reuse_port);
 static i32 set_nonblocking(i32 fd);
 
-static void server_accept_client(Server *server);
-static Connection *server_find_connection(Server *server, i32 fd);
-static Connection *server_find_free_connection(Server *server);
-static bool server_handle_connection(Server *server, Connection *connection);
-
-static void patterns_tree_add(Segment_Pattern **tree, Segment_Pattern *segment);
-static Http_Handler *find_handler_while_adding_path_params(Segment_Pattern **request_patterns,
-                                                           Segment_Pattern *server_patterns);
-static i32 events_add_fd(i32 events_fd, i32 fd);
+static i32 worker_init(Worker *worker, Server *server, u32 id, i32 fd);
+static void *worker_run(void *data);
+static void events_run(Worker *worker);
+static void worker_wakeup(Worker *worker);
+static void worker_accept_client(Worker *worker);
+static Connection *worker_alloc_connection(Worker *worker);
+static void worker_release_connection(Worker *worker, Connection *connection);
+static void worker_grow_connections(Worker *worker);
+static void worker_attach_context(Worker *worker, Connection *connection);
+static void worker_detach_context(Worker *worker, Connection *connection);
+static void worker_grow_contexts(Worker *worker);
+static bool worker_handle_connection(Worker *worker, Connection *connection);
+static bool worker_handle_writable(Worker *worker, Connection *connection);
+static void worker_update_interest(Worker *worker, Connection *connection);
+static void worker_close_connection(Worker *worker, Connection *connection);
+static void worker_update_timeout(Worker *worker, Connection *connection);
+static void worker_expire_timers(Worker *worker);
+static void worker_abort_connection(Worker *worker, Connection *connection);
+static void worker_close_wakeup(Worker *worker);
+static void worker_drain_offload(Worker *worker);
+static void worker_finish_offload(Worker *worker, Offload_Job *job);
+static bool connection_process_input(Worker *worker, Connection *connection);
+static bool connection_begin_body(Worker *worker, Connection *connection);
+static void connection_reject_body(Connection *connection);
+static Route *server_find_route(Server *server, Request *request);
+static Route *server_find_method_route(Server *server, Request *request, Http_Method method);
+
+static i32 offload_pool_start(Server *server);
+static void offload_pool_stop(Server *server);
+static bool offload_submit(Worker *worker, Connection *connection, Http_Handler *handler);
+static void *offload_thread_run(void *data);
+
+static void server_add_route(Server *server, char *pattern, Http_Handler *handler,
+                             Http_Body_Handler *body_handler, u32 flags);
+static u32 server_path_param_id(Server *server, String name);
+static void server_freeze_routes(Server *server);
+static Route_Builder_Node *router_builder_node(Arena *arena, String prefix);
+static void router_builder_add(Arena *arena, Route_Builder_Node *root, Route *route);
+static Route_Builder_Node *router_builder_add_literal(Arena *arena, Route_Builder_Node *node, String literal);
+static void router_compile(Router *router, Arena *arena, Route_Builder_Node *root);
+static void router_measure(Router *router, Route_Builder_Node *node);
+static u32 router_compile_node(Router *router, Route_Builder_Node *builder_node);
+static Route *router_match(Router *router, u32 node_index, Request *request, u32 at);
+static Route *router_descend(Router *router, u32 node_index, Request *request, u32 at, Catch_All_Match *catch_all);
+static u32 router_find_child(Router *router, Route_Node *node, u8 c);
+static void static_routes_build(Static_Routes *table, Arena *arena, Arena *scratch, Route *first_route);
+static bool static_routes_place(Static_Routes *table, Route **routes, u32 routes_count, u64 *hashes,
+                                u32 *buckets_order, u32 *buckets_start);
+static Route *static_routes_find(Static_Routes *table, Http_Method method, String path);
+static u64 static_routes_hash(Http_Method method, String path, u64 seed);
+static inline u64 static_routes_mix(u64 hash, u64 word);
+static inline u64 load_u64(const u8 *data);
+static inline u32 load_u32(const u8 *data);
+static inline u32 static_routes_slot(Static_Routes *table, u64 hash, u32 displacement);
+static String route_static_path(Route *route);
+static i32 events_add_fd(i32 events_fd, i32 fd, void *data, u32 flags);
+static i32 events_modify_fd(i32 events_fd, i32 fd, void *data, u32 flags, u32 old_interest, u32 interest);
 static i32 events_remove_fd(i32 events_fd, i32 fd);
 
+static u64 monotonic_ms(void);
+static u64 monotonic_ns(void);
+static void timer_wheel_init(Timer_Wheel *wheel);
+static void timer_wheel_insert(Timer_Wheel *wheel, Connection *connection);
+static void timer_wheel_remove(Timer_Wheel *wheel, Connection *connection);
+
+#if OS_LINUX
+static i32 uring_init(Worker *worker);
+static bool uring_probe_recv_multishot(Uring *uring);
+static struct io_uring_sqe *uring_get_sqe(Uring *uring);
+static i32 uring_submit(Uring *uring, u32 wait);
+static void uring_run(Worker *worker);
+static void uring_recycle_buffer(Uring *uring, u16 buffer_id);
+static void uring_queue_accept(Worker *worker);
+static void uring_queue_wakeup(Worker *worker);
+static void uring_queue_tick(Worker *worker);
+static void uring_queue_recv(Worker *worker, Connection *connection);
+static void uring_pause_recv(Worker *worker, Connection *connection);
+static void uring_resume_recv(Worker *worker, Connection *connection);
+static void uring_flush_output(Worker *worker, Connection *connection);
+static void uring_close_connection(Worker *worker, Connection *connection);
+#endif
+
 static void connection_init(Connection *connection, i32 fd, struct sockaddr_in address);
-static i32 connection_write(Connection *connection, Response response);
+static void connection_context_reset(Connection_Context *context, Buffer_Pool *pool);
+static void connection_context_next_request(Connection_Context *context);
+static bool connection_context_idle(Connection_Context *context);
+static void connection_write(Connection *connection, Response response);
+static String connection_encode_response(Arena *arena, Connection *connection, Response response);
+static Arena *connection_output_arena(Connection_Context *context);
+static void connection_push_output(Connection_Context *context, String data);
+static i32 connection_flush_output(Connection *connection);
+static void connection_consume_output(Connection_Context *context, u64 size);
 
 static String encode_response(Arena *arena, Response response);
 
-static void parser_init(Parser *parser, Arena *arena);
+static void parser_init(Parser *parser, Arena *arena, Buffer_Pool *pool);
 static char parser_get_char(Parser *parser);
-static Parser_Buffer *parser_push_buffer(Parser *parser);
-static u32 parser_parse_request(Parser *parser, Request *request);
+static Parser_Buffer *parser_read_buffer(Parser *parser);
+static void parser_release_buffers(Parser *parser);
+static void parser_recycle_buffers(Parser *parser);
+static bool parser_has_input(Parser *parser);
+static void parser_next_request(Parser *parser);
+static void parser_begin_body(Parser *parser, bool streaming);
+static void parser_append_chunk(Parser *parser, u8 *data, u32 size);
+static String parser_lower_in_place(String str);
+static u32 parser_find_cr(Parser_Buffer *buffer, u32 from, u32 to);
+static u32 parser_skip_class(Parser_Buffer *buffer, u32 from, u32 to, Char_Class char_class);
+static u32 parser_skip_uri_chars(Parser_Buffer *buffer, u32 from, u32 to);
+static void parser_parse_request(Parser *parser, Request *request);
+static bool parser_parse_head(Parser *parser, Request *request);
+static u32 parser_find_head_end(Parser_Buffer *buffer, u32 from, u32 to);
+static void parser_end_headers(Parser *parser, Request *request);
+static Known_Header parser_known_header(String name);
+static bool parser_set_known_header(Parser *parser, Request *request, String value);
+static bool parser_is_only_chunked(String value);
+static Connection_Token parser_connection_token(String value);
+static Http_Method http_method_parse(String method);
 
 static void pattern_parser_parse(Pattern_Parser *pattern_parser, Arena *arena, String pattern_str);
-static void pattern_parser_add_segment(Pattern_Parser *parser, Arena *arena, String segment, bool is_path_param);
+static void pattern_parser_add_segment(Pattern_Parser *parser, Arena *arena, String segment,
+                                       bool is_path_param, bool is_catch_all);
 
 static String http_status_reason(u16 status);
 
 static void request_init(Request *request);
-static void request_add_uri_segments(Request *request, Arena *arena, String uri);
-static void request_add_segment_literal(Request *request, Arena *arena, String literal);
+static bool request_set_uri(Request *request, Arena *arena, String uri);
+static String request_route_path(Arena *arena, String path);
+static void request_add_query_params(Request *request, Arena *arena, String query);
 static void request_add_query_param(Request *request, Arena *arena, String key, String value);
 
+static bool uri_check_escapes(String uri);
+static String uri_decode(Arena *arena, String encoded, bool plus_as_space);
+static u32 uri_decode_into(u8 *data, String encoded, bool plus_as_space);
+static bool uri_component_eq(String encoded, String decoded, bool plus_as_space);
+static u32 uri_decode_unreserved(u8 *data, String encoded);
+
 static void response_init(Response *response);
 
 static void headers_init(Headers_Map *headers_map);
 static void headers_put(Headers_Map *headers_map, String field_name, String field_value);
 
+static Parser_Buffer *buffer_pool_get(Buffer_Pool *pool);
+static void buffer_pool_put(Buffer_Pool *pool, Parser_Buffer *buffer);
+static void buffer_pool_grow(Buffer_Pool *pool);
+static u64 process_rss_bytes(void);
+
 
 static volatile bool main_running = true;
 
@@ -47,15 +157,225 @@ Server *http_server_make(Arena *arena) {
 
     *server = (Server){0};
     server->arena = arena;
+    server->workers_count = 1;
+    server->reuse_port = true;
+    server->edge_triggered = false;
+    server->backend = EVENTS_BACKEND_EPOLL;
+    server->output_high_water_mark = OUTPUT_HIGH_WATER_MARK;
+    server->arena_high_water_mark = CONTEXT_ARENA_HIGH_WATER_MARK;
+    server->idle_timeout_ms = IDLE_TIMEOUT_MS;
+    server->headers_timeout_ms = HEADERS_TIMEOUT_MS;
+    server->body_timeout_ms = BODY_TIMEOUT_MS;
+    server->offload.threads_count = OFFLOAD_THREADS;
 
     return server;
 }
 
+/*
+ * Cantidad de threads del pool para los handlers bloqueantes. El pool se
+ * levanta solo si hay alguno registrado con HANDLER_FLAG_BLOCKING.
+ */
+void http_server_set_offload_threads(Server *server, u32 threads_count) {
+    if (threads_count == 0) {
+        panic_with_msg("http_server_set_offload_threads arg {threads_count} cannot be 0");
+    }
+
+    if (threads_count > MAX_OFFLOAD_THREADS) {
+        threads_count = MAX_OFFLOAD_THREADS;
+    }
+
+    server->offload.threads_count = threads_count;
+}
+
+Offload_Stats http_server_get_offload_stats(Server *server) {
+    Offload_Pool *pool = &server->offload;
+
+    if (pool->threads_started == 0) {
+        return pool->stats;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    Offload_Stats stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+
+    stats.jobs_completed = __atomic_load_n(&pool->stats.jobs_completed, __ATOMIC_RELAXED);
+
+    return stats;
+}
+
+Memory_Stats http_server_get_memory_stats(Server *server) {
+    Memory_Stats stats = {0};
+
+    stats.rss_bytes = process_rss_bytes();
+
+    for (u32 i = 0; i < server->workers_count && server->workers; i++) {
+        Worker *worker = &server->workers[i];
+
+        stats.connections_open += __atomic_load_n(&worker->connections_open, __ATOMIC_RELAXED);
+        stats.contexts_count += __atomic_load_n(&worker->contexts_count, __ATOMIC_RELAXED);
+        stats.contexts_in_use += __atomic_load_n(&worker->contexts_in_use, __ATOMIC_RELAXED);
+
+        u32 buffers_count = __atomic_load_n(&worker->buffers.buffers_count, __ATOMIC_RELAXED);
+        stats.receive_buffers_bytes += (u64)buffers_count * MAX_PARSER_BUFFER_CAPACITY;
+    }
+
+    if (stats.connections_open > 0) {
+        stats.rss_per_connection = stats.rss_bytes / stats.connections_open;
+    }
+
+    return stats;
+}
+
+/*
+ * Id de un nombre de path param, para leerlo con
+ * http_request_get_path_param_by_id sin comparar strings en cada request.
+ * Es el mismo en todas las rutas que tengan un param con ese nombre. Se
+ * resuelve una vez antes de http_server_start; despues solo se pueden
+ * buscar los nombres que ya estan en alguna ruta, y para el resto
+ * devuelve PATH_PARAM_ID_NONE.
+ */
+u32 http_server_path_param_id(Server *server, char *name) {
+    if (name == NULL) {
+        panic_with_msg("http_server_path_param_id arg {name} cannot be null" );
+    }
+
+    return server_path_param_id(server, string(name));
+}
+
+static u32 server_path_param_id(Server *server, String name) {
+    for (u32 id = 0; id < server->path_param_names_count; id++) {
+        if (string_eq(server->path_param_names[id], name)) {
+            return id;
+        }
+    }
+
+    // con los routers armados los workers pueden estar leyendo, no se agrega nada
+    if (server->routes_frozen) {
+        return PATH_PARAM_ID_NONE;
+    }
+
+    if (server->path_param_names_count == MAX_PATH_PARAM_NAMES) {
+        panic_with_msg("too many different path param names" );
+    }
+
+    server->path_param_names[server->path_param_names_count] = name;
+    return server->path_param_names_count++;
+}
+
+/*
+ * Cantidad de bytes de respuestas sin enviar a partir de la cual se deja de
+ * leer de esa conexion hasta que el cliente consuma lo pendiente.
+ */
+void http_server_set_output_high_water_mark(Server *server, u64 bytes) {
+    server->output_high_water_mark = bytes;
+}
+
+/*
+ * Cuanta memoria se queda cada arena de un contexto (la del request y las
+ * dos de salida) entre un request y otro. Lo que use un request grande por
+ * encima de esto se le devuelve al sistema cuando la arena se reinicia.
+ * 0 no devuelve nunca nada.
+ */
+void http_server_set_arena_high_water_mark(Server *server, u64 bytes) {
+    server->arena_high_water_mark = bytes;
+}
+
+/*
+ * idle: conexion keep-alive sin ningun request en curso.
+ * headers: desde el primer byte de un request hasta el final de los headers.
+ * body: desde el final de los headers hasta el final del body.
+ * Los dos ultimos no se renuevan con cada read, asi un cliente que manda
+ * de a un byte no puede quedarse con la conexion. 0 desactiva el timeout.
+ */
+void http_server_set_timeouts(Server *server, u32 idle_ms, u32 headers_ms, u32 body_ms) {
+    server->idle_timeout_ms = idle_ms;
+    server->headers_timeout_ms = headers_ms;
+    server->body_timeout_ms = body_ms;
+}
+
+/*
+ * En modo edge-triggered epoll/kqueue avisan solo cuando llegan datos nuevos,
+ * asi que cada evento se atiende hasta recibir EAGAIN (tanto el accept como
+ * las lecturas de las conexiones).
+ */
+void http_server_set_edge_triggered(Server *server, bool edge_triggered) {
+    server->edge_triggered = edge_triggered;
+}
+
+/*
+ * Con reuse_port (default) cada worker tiene su propio socket de escucha.
+ * Sin reuse_port todos los workers comparten un unico socket, registrado
+ * con EPOLLEXCLUSIVE para que cada conexion nueva despierte a un solo worker.
+ */
+void http_server_set_reuse_port(Server *server, bool reuse_port) {
+    server->reuse_port = reuse_port;
+}
+
+/*
+ * Elige el mecanismo de eventos de los workers. io_uring solo existe en
+ * linux; si el kernel no lo soporta el worker vuelve a usar epoll.
+ */
+void http_server_set_backend(Server *server, Events_Backend backend) {
+    server->backend = backend;
+}
+
+/*
+ * Cantidad de threads que van a atender conexiones.
+ * Con 0 se usa un worker por cada core disponible.
+ */
+void http_server_set_workers(Server *server, u32 workers_count) {
+    if (workers_count == 0) {
+        i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers_count = cores > 0 ? (u32)cores : 1;
+    }
+
+    if (workers_count > MAX_WORKERS) {
+        workers_count = MAX_WORKERS;
+    }
+
+    server->workers_count = workers_count;
+}
+
 void http_server_handle(Server *server, char *pattern, Http_Handler *handler) {
+    http_server_handle_with_flags(server, pattern, handler, HANDLER_FLAG_NONE);
+}
+
+/*
+ * Igual que http_server_handle. Con HANDLER_FLAG_BLOCKING el handler corre
+ * en el pool de offload: puede leer archivos o esperar a otro servicio sin
+ * frenar al resto de las conexiones del worker.
+ */
+void http_server_handle_with_flags(Server *server, char *pattern, Http_Handler *handler, u32 flags) {
+    server_add_route(server, pattern, handler, NULL, flags);
+}
+
+/*
+ * Para bodies de cualquier tamanio. En vez de juntar el body en
+ * request->body (hasta MAX_BODY_SIZE), body_handler recibe cada pedazo a
+ * medida que llega del socket, sin copiarlo, y el buffer se reusa para el
+ * proximo read: la memoria de la conexion no depende del Content-Length.
+ * Cuando llega el ultimo pedazo se llama a handler para responder.
+ * Si la conexion se corta a mitad del body handler no se llama.
+ */
+void http_server_handle_stream(Server *server, char *pattern, Http_Body_Handler *body_handler,
+                               Http_Handler *handler, u32 flags) {
+    if (body_handler == NULL) {
+        panic_with_msg("http_server_handle_stream arg {body_handler} cannot be null" );
+    }
+
+    server_add_route(server, pattern, handler, body_handler, flags);
+}
+
+static void server_add_route(Server *server, char *pattern, Http_Handler *handler,
+                             Http_Body_Handler *body_handler, u32 flags) {
     if (pattern == NULL || handler == NULL) {
         panic_with_msg("http_server_handle args {pattern} and {handler} cannot be null" );
     }
 
+    if (server->routes_frozen) {
+        panic_with_msg("http_server_handle cannot be called after http_server_start" );
+    }
+
     String pattern_str = string(pattern);
     if (pattern_str.size == 0) {
         panic_with_msg("http_server_handle arg {pattern} cannot be empty" );
@@ -68,18 +388,59 @@ void http_server_handle(Server *server, char *pattern, Http_Handler *handler) {
         panic_with_msg("http_server_handle failed to parse pattern" );
     }
 
-    parser.last_segment->handler = handler;
+    Route *route = arena_alloc(server->arena, sizeof(Route));
+    *route = (Route){0};
+    route->method = parser.method;
+    route->first_segment = parser.first_segment;
+    route->handler = handler;
+    route->body_handler = body_handler;
+    route->handler_flags = flags;
+
+    // cada param tiene el slot de su posicion en el pattern
+    for (Segment_Pattern *segment = parser.first_segment; segment != NULL; segment = segment->next_segment) {
+        if (!segment->is_path_param) {
+            continue;
+        }
+
+        if (route->path_params_count == ROUTE_MAX_PATH_PARAMS) {
+            panic_with_msg("http_server_handle arg {pattern} has too many path params" );
+        }
+
+        for (u32 slot = 0; slot < route->path_params_count; slot++) {
+            if (string_eq(route->path_param_names[slot], segment->segment)) {
+                panic_with_msg("http_server_handle arg {pattern} has a repeated path param" );
+            }
+        }
+
+        route->path_param_names[route->path_params_count] = segment->segment;
+        route->path_param_ids[route->path_params_count] = server_path_param_id(server, segment->segment);
+        route->path_params_count++;
+    }
+
+    if (flags & HANDLER_FLAG_BLOCKING) {
+        server->has_blocking_handlers = true;
+    }
 
-    patterns_tree_add(&server->patterns_tree, parser.first_segment);
+    if (server->first_route == NULL) {
+        server->first_route = route;
+    } else {
+        server->last_route->next = route;
+    }
+    server->last_route = route;
 }
 
 /*
  * Parsea el patron del path.
  * Estos path tienen el formato:
  *
- * [GET|POST|PUT] /foo/{bar}/baz
+ * [GET|HEAD|POST|PUT|DELETE|CONNECT|OPTIONS|TRACE|PATCH] /foo/{bar}/baz
  *
- * Esto crea una lista de segmentos dentro del parser.
+ * Un {*name} se lleva el resto del path, con sus '/', y por eso solo puede
+ * ser el ultimo segmento: /static/{*path}
+ *
+ * El metodo elige en que arbol de rutas se agrega; un HEAD que no tiene
+ * ruta propia se atiende con la del GET. El path se convierte en una lista
+ * de segmentos dentro del parser.
  */
 static void pattern_parser_parse(Pattern_Parser *pattern_parser, Arena *arena, String pattern_str) {
  
@@ -105,20 +466,12 @@ static void pattern_parser_parse(Pattern_Parser *pattern_parser, Arena *arena, S
                     break;
                 }
 
-                String method = string_with_len(pattern_str.data, i);
-
-                if (string_eq(method, string_lit("GET"))  ||
-                    string_eq(method, string_lit("PUT"))  ||
-                    string_eq(method, string_lit("POST")) ||
-                    string_eq(method, string_lit("DELETE"))) {
+                pattern_parser->method = http_method_parse(string_with_len(pattern_str.data, i));
 
-                    pattern_parser_add_segment(pattern_parser, arena, method, false);
+                if (pattern_parser->method != HTTP_METHOD_UNKNOWN) {
                     pattern_parser->state = PATTERN_PARSER_STATE_PARSING_SLASH;
-
                 } else {
-
                     pattern_parser->state = PATTERN_PARSER_STATE_FAILED;
-
                 }
 
                 break;
@@ -156,7 +509,7 @@ static void pattern_parser_parse(Pattern_Parser *pattern_parser, Arena *arena, S
                 }
 
                 String segment = string_with_len(pattern_str.data + slash_pos + 1, i - slash_pos - 1);
-                pattern_parser_add_segment(pattern_parser, arena, segment, false);
+                pattern_parser_add_segment(pattern_parser, arena, segment, false, false);
 
                 slash_pos = i;
 
@@ -171,16 +524,25 @@ static void pattern_parser_parse(Pattern_Parser *pattern_parser, Arena *arena, S
                     break;
                 }
 
+                // {*name}: el '*' solo puede ir pegado a la llave
+                bool is_catch_all = pattern_str.data[open_brace_pos + 1] == '*';
+                if (c == '*' && i == open_brace_pos + 1) {
+                    break;
+                }
+
                 if (c != '}') {
                     pattern_parser->state = PATTERN_PARSER_STATE_FAILED;
                     break;
                 }
 
-                String segment = string_with_len(pattern_str.data + open_brace_pos + 1, i - open_brace_pos - 1);
-                pattern_parser_add_segment(pattern_parser, arena, segment, true);
+                u32 name_start = open_brace_pos + 1 + is_catch_all;
+                String segment = string_with_len(pattern_str.data + name_start, i - name_start);
+                pattern_parser_add_segment(pattern_parser, arena, segment, true, is_catch_all);
 
                 if (i == pattern_str.size -1) {
                     pattern_parser->state = PATTERN_PARSER_STATE_FINISHED;
+                } else if (is_catch_all) {
+                    pattern_parser->state = PATTERN_PARSER_STATE_FAILED;
                 } else {
                     pattern_parser->state = PATTERN_PARSER_STATE_PARSING_SLASH;
                 }
@@ -198,26 +560,24 @@ static void pattern_parser_parse(Pattern_Parser *pattern_parser, Arena *arena, S
         pattern_parser->state == PATTERN_PARSER_STATE_PARSING_SLASH) {
 
         String segment = string_with_len(pattern_str.data + slash_pos + 1, pattern_str.size - slash_pos - 1);
-        pattern_parser_add_segment(pattern_parser, arena, segment, false);
+        pattern_parser_add_segment(pattern_parser, arena, segment, false, false);
 
         pattern_parser->state = PATTERN_PARSER_STATE_FINISHED;
     }
 }
 
-static void pattern_parser_add_segment(Pattern_Parser *parser, Arena *arena, String segment, bool is_path_param) {
+static void pattern_parser_add_segment(Pattern_Parser *parser, Arena *arena, String segment,
+                                       bool is_path_param, bool is_catch_all) {
     Segment_Pattern *segment_pattern = arena_alloc(arena, sizeof(Segment_Pattern));
     segment_pattern->segment = segment;
     segment_pattern->is_path_param = is_path_param;
-    segment_pattern->handler = NULL;
+    segment_pattern->is_catch_all = is_catch_all;
     segment_pattern->next_segment = NULL;
-    segment_pattern->first_segment = segment_pattern;
-    segment_pattern->last_segment = segment_pattern;
-    segment_pattern->child_segments = NULL;
 
     if (parser->first_segment == NULL && parser->last_segment == NULL) {
         parser->first_segment = segment_pattern;
     } else {
-        parser->last_segment->child_segments = segment_pattern;
+        parser->last_segment->next_segment = segment_pattern;
     }
     parser->last_segment = segment_pattern;
 }
@@ -228,75 +588,299 @@ i32 http_server_start(Server *server, u32 port, char *host) {
         return EXIT_FAILURE;
     }
 
-    i32 server_fd = start_listening(port, host);    
+    server_freeze_routes(server);
+
+    bool reuse_port = server->reuse_port && server->workers_count > 1;
+
+    server->workers = arena_alloc(server->arena, sizeof(Worker) * server->workers_count);
+
+    i32 shared_fd = -1;
+    if (!reuse_port) {
+        shared_fd = start_listening(port, host, false);
+    }
+
+    for (u32 i = 0; i < server->workers_count; i++) {
+        i32 server_fd = reuse_port ? start_listening(port, host, true) : shared_fd;
+
+        if (worker_init(&server->workers[i], server, i, server_fd) == -1) {
+            printf("error al iniciar el worker %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("Servidor escuchando en: %s:%d (%d workers)\n", host, port, server->workers_count);
+
+    // Los workers secundarios no reciben SIGINT, asi la signal siempre
+    // cae en el thread principal y es este el que despierta al resto.
+    sigset_t blocked_signals;
+    sigset_t previous_signals;
+    sigemptyset(&blocked_signals);
+    sigaddset(&blocked_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked_signals, &previous_signals);
+
+    if (server->has_blocking_handlers && offload_pool_start(server) == -1) {
+        printf("error al crear los threads de offload\n");
+        main_running = false;
+    }
+
+    u32 threads_started = 1;
+    for (u32 i = 1; i < server->workers_count && main_running; i++) {
+        Worker *worker = &server->workers[i];
+        if (pthread_create(&worker->thread, NULL, &worker_run, worker) != 0) {
+            printf("error al crear el thread del worker %d\n", i);
+            main_running = false;
+            break;
+        }
+        threads_started++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+
+    if (main_running) {
+        worker_run(&server->workers[0]);
+    }
+
+    for (u32 i = 1; i < threads_started; i++) {
+        worker_wakeup(&server->workers[i]);
+    }
+
+    for (u32 i = 1; i < threads_started; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+    }
+
+    // el pool puede seguir despertando workers hasta que termina
+    offload_pool_stop(server);
+
+    for (u32 i = 0; i < server->workers_count; i++) {
+        worker_close_wakeup(&server->workers[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static i32 worker_init(Worker *worker, Server *server, u32 id, i32 fd) {
+    *worker = (Worker){0};
+    worker->server = server;
+    worker->id = id;
+    worker->fd = fd;
+    worker->backend = server->backend;
+
+    timer_wheel_init(&worker->timers);
+
+#if OS_LINUX
+    i32 wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        return -1;
+    }
+    worker->wakeup_fds[0] = wakeup_fd;
+    worker->wakeup_fds[1] = wakeup_fd;
+#else
+    if (pipe(worker->wakeup_fds) == -1) {
+        return -1;
+    }
+#endif
+
+    worker_grow_connections(worker);
+
+#if OS_LINUX
+    if (worker->backend == EVENTS_BACKEND_IO_URING) {
+        if (uring_init(worker) == 0) {
+            return 0;
+        }
+        printf("io_uring no disponible, el worker %d usa epoll\n", id);
+        worker->backend = EVENTS_BACKEND_EPOLL;
+    }
+#else
+    worker->backend = EVENTS_BACKEND_EPOLL;
+#endif
 
-    i32 events_fd;
 #if OS_MAC
-    struct kevent eventlist[MAX_EVENTS];
-    events_fd = kqueue();
+    worker->events_fd = kqueue();
 #else
-    struct epoll_event epoll_events[MAX_EVENTS];
-    events_fd = epoll_create1(0);
+    worker->events_fd = epoll_create1(0);
 #endif
 
-    if (events_fd == -1) {
-        return EXIT_FAILURE;
+    if (worker->events_fd == -1) {
+        return -1;
+    }
+
+    if (server->edge_triggered) {
+        worker->events_flags = EVENTS_FLAG_EDGE_TRIGGERED;
     }
 
-    if (events_add_fd(events_fd, server_fd) == -1) {
+    u32 listener_flags = worker->events_flags;
+    if (!server->reuse_port && server->workers_count > 1) {
+        listener_flags |= EVENTS_FLAG_EXCLUSIVE;
+    }
+
+    if (events_add_fd(worker->events_fd, fd, worker, listener_flags) == -1) {
         printf("error al agregar server_fd al epoll events\n");
-        return EXIT_FAILURE;
+        return -1;
+    }
+
+    if (events_add_fd(worker->events_fd, worker->wakeup_fds[0], worker->wakeup_fds, EVENTS_FLAG_NONE) == -1) {
+        printf("error al agregar el wakeup_fd al epoll events\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void worker_wakeup(Worker *worker) {
+#if OS_LINUX
+    u64 value = 1;
+    write(worker->wakeup_fds[1], &value, sizeof(value));
+#else
+    u8 byte = 1;
+    write(worker->wakeup_fds[1], &byte, 1);
+#endif
+}
+
+static void worker_close_wakeup(Worker *worker) {
+    close(worker->wakeup_fds[0]);
+    if (worker->wakeup_fds[1] != worker->wakeup_fds[0]) {
+        close(worker->wakeup_fds[1]);
+    }
+}
+
+static void *worker_run(void *data) {
+    Worker *worker = (Worker *)data;
+
+#if OS_LINUX
+    if (worker->backend == EVENTS_BACKEND_IO_URING) {
+        uring_run(worker);
+    } else {
+        events_run(worker);
+    }
+#else
+    events_run(worker);
+#endif
+
+    // el socket compartido lo cierra unicamente el primer worker
+    if (worker->server->reuse_port || worker->id == 0) {
+        close(worker->fd);
     }
 
-    server->fd = server_fd;
-    server->events_fd = events_fd;
-    server->connections_count = MAX_CONNECTIONS;
-    server->connections = arena_alloc(server->arena, sizeof(Connection) * server->connections_count);
+    return NULL;
+}
+
+/*
+ * Event loop de epoll (kqueue en macOS): avisa cuando un fd esta listo y
+ * despues se hace el accept/read correspondiente.
+ */
+static void events_run(Worker *worker) {
+
+#if OS_MAC
+    struct kevent eventlist[MAX_EVENTS];
+#else
+    struct epoll_event epoll_events[MAX_EVENTS];
+#endif
 
     while (main_running) {
 
+        // Si hay timers se despierta por lo menos una vez por tick
+        bool has_timers = worker->timers.timers_count > 0;
+
         i32 events_count;
 #if OS_MAC
-        events_count = kevent(events_fd, NULL, 0, eventlist, MAX_EVENTS, NULL);
+        struct timespec tick = { .tv_sec = 0, .tv_nsec = TIMER_WHEEL_TICK_MS * 1000000L };
+        events_count = kevent(worker->events_fd, NULL, 0, eventlist, MAX_EVENTS, has_timers ? &tick : NULL);
 #else
-        events_count = epoll_wait(events_fd, epoll_events, MAX_EVENTS, -1);
+        events_count = epoll_wait(worker->events_fd, epoll_events, MAX_EVENTS, has_timers ? TIMER_WHEEL_TICK_MS : -1);
 #endif
         if (events_count == -1) {
             continue;
         }
 
+        // Con el wheel vacio pudo haber dormido mucho tiempo: se pone al dia
+        // antes de que las conexiones calculen su deadline.
+        if (!has_timers) {
+            worker_expire_timers(worker);
+        }
+
+        // El wakeup se atiende despues del batch: terminar un offload puede
+        // liberar una conexion que todavia tiene eventos mas adelante.
+        bool woken = false;
+
         for (u32 i = 0; i < events_count; i++) {
 
-            i32 event_fd;
+            // Cada fd se registra con un puntero a quien le pertenece: el worker para el
+            // socket de escucha, el pipe de wakeup o directamente la Connection.
+            void *event_data;
+#if OS_MAC
+            event_data = eventlist[i].udata;
+#else
+            event_data = epoll_events[i].data.ptr;
+#endif
+            if (event_data == worker) {
+                worker_accept_client(worker);
+                continue;
+            }
+
+            if (event_data == worker->wakeup_fds) {
+                woken = true;
+                continue;
+            }
+
+            Connection *connection = (Connection *)event_data;
+
+            // se cerro por un evento anterior del mismo batch
+            if (!connection->is_active) {
+                continue;
+            }
+
+            bool readable;
+            bool writable;
+            bool hangup;
 #if OS_MAC
-            event_fd = eventlist[i].ident;
+            readable = eventlist[i].filter == EVFILT_READ;
+            writable = eventlist[i].filter == EVFILT_WRITE;
+            hangup = eventlist[i].flags & (EV_EOF | EV_ERROR);
 #else
-            event_fd = epoll_events[i].data.fd;
+            readable = epoll_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+            writable = epoll_events[i].events & EPOLLOUT;
+            hangup = epoll_events[i].events & (EPOLLHUP | EPOLLERR);
 #endif
-            if (event_fd == server->fd) {
-                server_accept_client(server);
+
+            if (connection->waiting_offload) {
+                // el handler sigue en el pool: solo importa si se corto
+                if (hangup && connection->state != CONNECTION_STATE_FAILED) {
+                    worker_abort_connection(worker, connection);
+                }
+                continue;
+            }
+
+            if (writable && worker_handle_writable(worker, connection)) {
+                worker_close_connection(worker, connection);
                 continue;
             }
 
-            Connection *connection = server_find_connection(server, event_fd);
-            if (connection == NULL) {
-                printf("error: no se logro encontrar la conexion\n");
-                events_remove_fd(events_fd, event_fd);
+            if (readable && connection->state == CONNECTION_STATE_ACTIVE &&
+                    worker_handle_connection(worker, connection)) {
+                worker_close_connection(worker, connection);
                 continue;
             }
 
-            bool remove_connection = server_handle_connection(server, connection);
-            if (remove_connection) {
-                events_remove_fd(events_fd, connection->fd);
-                connection->is_active = false;
+            if (connection->is_active) {
+                worker_update_timeout(worker, connection);
             }
         }
-    }
 
-    close(server->events_fd);
-    close(server->fd);
+        if (woken) {
+#if OS_LINUX
+            u64 value;
+            read(worker->wakeup_fds[0], &value, sizeof(value));
+#else
+            u8 byte;
+            read(worker->wakeup_fds[0], &byte, 1);
+#endif
+            worker_drain_offload(worker);
+        }
+
+        worker_expire_timers(worker);
+    }
 
-    return EXIT_SUCCESS;
+    close(worker->events_fd);
 }
 
 Body http_request_get_body(Request *request) {
@@ -320,30 +904,86 @@ Headers_Map http_request_get_headers(Request *request) {
  * Ejemplo: `/foo/{bar}`
  * En este caso el nombre de la variable seria "bar".
  * En caso de no encontrar el atributo, retorna un string vacio.
+ * Compara el nombre contra los de la ruta en cada llamada: si un handler
+ * lee varios params conviene http_request_get_path_param_at o _by_id.
  */
 String http_request_get_path_param(Request *request, String name) {
-    
-    for (Segment_Pattern *segment = request->first_segment;
-         segment != NULL;
-         segment = segment->next_segment) {
+    Route *route = request->route;
+    if (route == NULL) {
+        return string_lit("");
+    }
+
+    for (u32 slot = 0; slot < route->path_params_count; slot++) {
+        if (string_eq(route->path_param_names[slot], name)) {
+            return http_request_get_path_param_at(request, slot);
+        }
+    }
+
+    return string_lit("");
+}
+
+/*
+ * El path param por su posicion en el pattern de la ruta: en
+ * "GET /users/{id}/orders/{order}" id es el slot 0 y order el 1. Si el
+ * slot no existe retorna un string vacio. Un {*name} es siempre el ultimo
+ * slot y trae el resto del path con sus '/'.
+ *
+ * Se decodifica la primera vez que se pide: si tiene '%' route_path es una
+ * copia en la arena (ver request_route_path), asi que se decodifica en el
+ * lugar.
+ */
+String http_request_get_path_param_at(Request *request, u32 slot) {
+    if (slot >= request->path_params_count) {
+        return string_lit("");
+    }
 
-        if (segment->is_path_param && 
-                string_eq(segment->path_param_name, name)) {
+    Path_Param *param = &request->path_params[slot];
+    u8 *data = (u8 *)request->route_path.data + param->offset;
 
-            return segment->segment;
+    if (!param->is_decoded) {
+        if (memchr(data, '%', param->size)) {
+            param->size = uri_decode_into(data, string_with_len((char *)data, param->size), false);
         }
+        param->is_decoded = true;
+    }
+
+    return string_with_len((char *)data, param->size);
+}
+
+// El path param con el id de http_server_path_param_id, sirve para rutas
+// que tienen el mismo nombre en distintos slots.
+String http_request_get_path_param_by_id(Request *request, u32 id) {
+    Route *route = request->route;
+    if (route == NULL) {
+        return string_lit("");
+    }
 
+    for (u32 slot = 0; slot < route->path_params_count; slot++) {
+        if (route->path_param_ids[slot] == id) {
+            return http_request_get_path_param_at(request, slot);
+        }
     }
 
     return string_lit("");
 }
 
+/*
+ * Busca el query param por nombre decodificado y devuelve el valor
+ * decodificado, con '+' como espacio como en los formularios. Si no tenia
+ * escapes es una vista sobre el URI, si no una copia en la arena del request.
+ */
 String http_request_get_query_param(Request *request, String name) {
     for (Query_Param *qparam = request->first_query_param;
          qparam != NULL;
          qparam = qparam->next) {
 
-        if (string_eq(qparam->key, name)) {
+        if (uri_component_eq(qparam->key, name, true)) {
+
+            if (!qparam->is_decoded) {
+                qparam->value = uri_decode(request->arena, qparam->value, true);
+                qparam->is_decoded = true;
+            }
+
             return qparam->value;
         }
     }
@@ -376,7 +1016,7 @@ static i32 signals_init(void) {
     return 0;
 }
 
-static i32 start_listening(u32 port, char *host) {
+static i32 start_listening(u32 port, char *host, bool reuse_port) {
     // creacion del socket
     i32 fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd == -1) {
@@ -384,12 +1024,25 @@ static i32 start_listening(u32 port, char *host) {
         exit(EXIT_FAILURE);
     }
 
-    // address reutilizable, no hace falta esperar al TIME_WAIT
-    i32 reuse = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
+    // el accept se hace en loop hasta EAGAIN, no puede bloquear
+    if (set_nonblocking(fd) == -1) {
+        printf("error al setear el nonblocking\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // address reutilizable, no hace falta esperar al TIME_WAIT
+    i32 reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
         printf("error al realizar setsockopt(SO_REUSEADDR)\n");
         exit(EXIT_FAILURE);
     }
+
+    // cada worker tiene su propio socket escuchando en el mismo puerto
+    // y el kernel reparte las conexiones entrantes entre ellos
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        printf("error al realizar setsockopt(SO_REUSEPORT)\n");
+        exit(EXIT_FAILURE);
+    }
     
     // bind address al socket
     struct sockaddr_in server_addr = {
@@ -404,16 +1057,11 @@ static i32 start_listening(u32 port, char *host) {
     }
     
     // escuchar a traves del socket
-    if (listen(fd, MAX_CONNECTIONS) == -1) {
+    if (listen(fd, LISTEN_BACKLOG) == -1) {
         printf("error al realizar el listen\n");
         exit(EXIT_FAILURE);
     }
 
-    String server_host = string(inet_ntoa(server_addr.sin_addr));
-    u16 server_port = ntohs(server_addr.sin_port);
-
-    printf("Servidor escuchando en: %.*s:%d\n", string_print(server_host), server_port);
-
     return fd;
 }
 
@@ -430,934 +1078,3963 @@ static i32 set_nonblocking(i32 fd) {
     return 0;
 }
 
-static void server_accept_client(Server *server) {
+/*
+ * Acepta todas las conexiones pendientes hasta que accept devuelve EAGAIN,
+ * asi una rafaga de clientes se atiende con un solo evento.
+ */
+static void worker_accept_client(Worker *worker) {
 
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+    while (true) {
 
-    i32 client_fd = accept(server->fd, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (client_fd == -1) {
-        printf("error al aceptar cliente\n");
-        return;
-    }
-    
-    if (set_nonblocking(client_fd) == -1) {
-        printf("error al setear el nonblocking\n");
-        close(client_fd);
-        return;
-    }
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
 
-    Connection *connection = server_find_free_connection(server);
-    if (connection == NULL) {
-        printf("no hay conexiones libres\n");
-        close(client_fd);
-        return;
+#if OS_MAC
+        i32 client_fd = accept(worker->fd, (struct sockaddr *)&client_addr, &client_addr_len);
+#else
+        i32 client_fd = accept4(worker->fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK);
+#endif
+        if (client_fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("error al aceptar cliente\n");
+            }
+            return;
+        }
+
+#if OS_MAC
+        if (set_nonblocking(client_fd) == -1) {
+            printf("error al setear el nonblocking\n");
+            close(client_fd);
+            continue;
+        }
+#endif
+
+        Connection *connection = worker_alloc_connection(worker);
+        if (connection == NULL) {
+            printf("no hay conexiones libres\n");
+            close(client_fd);
+            continue;
+        }
+
+        if (events_add_fd(worker->events_fd, client_fd, connection, worker->events_flags) == -1) {
+            printf("error al agregar client_fd al epoll events\n");
+            worker_release_connection(worker, connection);
+            close(client_fd);
+            continue;
+        }
+
+        connection_init(connection, client_fd, client_addr);
+        worker_update_timeout(worker, connection);
     }
+}
 
-    if (events_add_fd(server->events_fd, client_fd) == -1) {
-        printf("error al agregar client_fd al epoll events\n");
-        close(client_fd);
-        return;
+/*
+ * Las conexiones libres forman una lista enlazada intrusiva (next_free),
+ * asi tomar y devolver una conexion es O(1) sin importar cuantas haya abiertas.
+ * Si no queda ninguna libre se reserva otro bloque; los bloques no se mueven
+ * porque epoll guarda punteros a las conexiones.
+ */
+static Connection *worker_alloc_connection(Worker *worker) {
+    if (worker->free_connections == NULL) {
+        worker_grow_connections(worker);
     }
 
-    connection_init(connection, client_fd, client_addr);
+    Connection *connection = worker->free_connections;
+
+    worker->free_connections = connection->next_free;
+    connection->next_free = NULL;
 
-    // TODO: Esto deberia quedar en un archivo de log
-    printf("Nuevo cliente aceptado: %.*s:%d\n", string_print(connection->host),
-            connection->port);
+    __atomic_store_n(&worker->connections_open, worker->connections_open + 1, __ATOMIC_RELAXED);
+
+    return connection;
 }
 
-static Connection *server_find_connection(Server *server, i32 fd) {
-    for (u32 i = 0; i < server->connections_count; i++) {
-        if (server->connections[i].fd == fd) {
-            return &server->connections[i];
-        }
-    }
+static void worker_release_connection(Worker *worker, Connection *connection) {
+    timer_wheel_remove(&worker->timers, connection);
+    connection->is_active = false;
+    connection->state = CONNECTION_STATE_FAILED;
+    connection->fd = -1;
+    connection->next_free = worker->free_connections;
+    worker->free_connections = connection;
 
-    return NULL;
+    __atomic_store_n(&worker->connections_open, worker->connections_open - 1, __ATOMIC_RELAXED);
 }
 
-static Connection *server_find_free_connection(Server *server) {
-    for (u32 i = 0; i < server->connections_count; i++) {
-        if (server->connections[i].is_active == false) {
-            return &server->connections[i];
-        }
+static void worker_grow_connections(Worker *worker) {
+    Arena *block = arena_make(sizeof(Connection) * CONNECTIONS_BLOCK_SIZE + DEFAULT_ALIGNMENT);
+    Connection *connections = arena_alloc(block, sizeof(Connection) * CONNECTIONS_BLOCK_SIZE);
+
+    for (u32 i = CONNECTIONS_BLOCK_SIZE; i > 0; i--) {
+        Connection *connection = &connections[i - 1];
+        connection->next_free = worker->free_connections;
+        worker->free_connections = connection;
     }
 
-    return NULL;
+    worker->connections_count += CONNECTIONS_BLOCK_SIZE;
 }
 
 static void connection_init(Connection *connection, i32 fd, struct sockaddr_in address) {
-    if (connection->arena == NULL) {
-        connection->arena = arena_make(1 * MB);
-    } else {
-        arena_reset(connection->arena);
-    }
-
     connection->fd = fd;
     connection->state = CONNECTION_STATE_ACTIVE;
-    connection->host = string(inet_ntoa(address.sin_addr));
-    connection->port = ntohs(address.sin_port); 
     connection->address = address; 
     connection->is_active = true;
     connection->keep_alive = false;
-    connection->request = (Request){0};
-    headers_init(&connection->request.headers_map);
-    parser_init(&connection->parser, connection->arena);
+    connection->events_interest = EVENTS_INTEREST_READ;
+    connection->context = NULL;
+    connection->timer_next = NULL;
+    connection->timer_pprev = NULL;
+    connection->timeout_kind = TIMEOUT_KIND_NONE;
 }
 
-static bool server_handle_connection(Server *server, Connection *connection) {
-    Parser *parser = &connection->parser;
-    Request *request = &connection->request;
+static void worker_grow_contexts(Worker *worker) {
+    Arena *block = arena_make(sizeof(Connection_Context) * CONTEXTS_BLOCK_SIZE + DEFAULT_ALIGNMENT);
+    Connection_Context *contexts = arena_alloc(block, sizeof(Connection_Context) * CONTEXTS_BLOCK_SIZE);
 
-    while (true) {
+    for (u32 i = CONTEXTS_BLOCK_SIZE; i > 0; i--) {
+        Connection_Context *context = &contexts[i - 1];
+        context->next_free = worker->free_contexts;
+        worker->free_contexts = context;
+    }
 
-        Parser_Buffer *buffer = parser_push_buffer(parser); 
+    __atomic_store_n(&worker->contexts_count, worker->contexts_count + CONTEXTS_BLOCK_SIZE, __ATOMIC_RELAXED);
+}
 
-        parser->bytes_read = read(connection->fd, buffer->data, buffer->size);
-        if (parser->bytes_read < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return false;
-            } else {
-                return true;
-            }
-        } else if (parser->bytes_read == 0) {
-            return true;
-        }
+/*
+ * Le asigna un contexto a la conexion cuando empieza a llegar un request.
+ * Los contextos se reciclan, con lo cual la arena se crea una unica vez.
+ * Las arenas reservan CONTEXT_ARENA_SIZE pero solo ocupan lo que se toca, y
+ * al reiniciarse devuelven lo que pase de arena_high_water_mark.
+ */
+static void worker_attach_context(Worker *worker, Connection *connection) {
+    if (worker->free_contexts == NULL) {
+        worker_grow_contexts(worker);
+    }
 
-        u32 bytes_parsed = 0;
+    Connection_Context *context = worker->free_contexts;
+    worker->free_contexts = context->next_free;
+    context->next_free = NULL;
 
-        while (bytes_parsed < parser->bytes_read) {
-            
-            bytes_parsed += parser_parse_request(parser, request);
-            
-            if (parser->state == PARSER_STATE_FINISHED) {
-                Http_Handler *handler = find_handler_while_adding_path_params(&request->first_segment,
-                                                                              server->patterns_tree);
-                if (handler) {
+    if (context->arena == NULL) {
+        context->arena = arena_make(CONTEXT_ARENA_SIZE);
+        context->output_arenas[0] = arena_make(CONTEXT_ARENA_SIZE);
+        context->output_arenas[1] = arena_make(CONTEXT_ARENA_SIZE);
 
-                    String *connection_value = http_headers_get(&request->headers_map, string_lit("connection"));
-                    if (connection_value == NULL) {
-                        connection->keep_alive = string_eq(request->version, HTTP_VERSION_11);
-                    } else {
-                        String connection_value_lower = string_to_lower(connection->arena, *connection_value);
-                        connection->keep_alive = string_eq(connection_value_lower, string_lit("keep-alive"));
-                    }
-                
-                    Response response;
-                    response_init(&response);
-                
-                    handler(request, &response);
-                
-                    if (connection_write(connection, response) == -1) {
-                        connection->state = CONNECTION_STATE_FAILED;
-                        break;
-                    }
-                
-                    request_init(request); 
+        u64 high_water_mark = worker->server->arena_high_water_mark;
+        arena_set_decommit_above(context->arena, high_water_mark);
+        arena_set_decommit_above(context->output_arenas[0], high_water_mark);
+        arena_set_decommit_above(context->output_arenas[1], high_water_mark);
+    }
 
-                } else {
-                    // TODO: responder un 404 o algo
-                }
-            } else if (parser->state == PARSER_STATE_FAILED) {
-                break;
-            } else {
-                String *expect = http_headers_get(&request->headers_map, string_lit("expect"));
-                if (string_eq(*expect, string_lit("100-continue"))) {
-                    Response response;
-                    response_init(&response);
-                    http_response_set_status(&response, 100);
-
-                    String *content_length = http_headers_get(&request->headers_map, string_lit("content-length"));
-                    if (content_length) {
-                        i64 body_size = string_to_i64(*content_length);
-                        if (body_size < 0 || body_size > MAX_BODY_SIZE) { 
-                            http_response_set_status(&response, 400);
-                        }
-                    }
-                    
-                    if (connection_write(connection, response) == -1) {
-                        connection->state = CONNECTION_STATE_FAILED;
-                        break;
-                    }
-                } else {
-                    // TODO: logging
-                }
-            }
-        }
+    connection_context_reset(context, &worker->buffers);
 
-        if (parser->state == PARSER_STATE_FAILED ||
-            connection->state == CONNECTION_STATE_FAILED) {
-            break;
-        }
-    }
+    connection->context = context;
+    __atomic_store_n(&worker->contexts_in_use, worker->contexts_in_use + 1, __ATOMIC_RELAXED);
+}
 
-    if (!(parser->state == PARSER_STATE_FINISHED || 
-                parser->state == PARSER_STATE_STARTED) || 
-        connection->state == CONNECTION_STATE_FAILED) {
-        return true;
+static void worker_detach_context(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
+    if (context == NULL) {
+        return;
     }
 
-    if (connection->keep_alive) {
-        connection_init(connection, connection->fd, connection->address);
-        connection->keep_alive = true;
-        return false;
-    } 
+    parser_release_buffers(&context->parser);
 
-    return true;
+    // en la free list el contexto no se queda con mas que el high water mark
+    arena_reset(context->arena);
+    arena_reset(context->output_arenas[0]);
+    arena_reset(context->output_arenas[1]);
+
+    context->next_free = worker->free_contexts;
+    worker->free_contexts = context;
+
+    connection->context = NULL;
+    __atomic_store_n(&worker->contexts_in_use, worker->contexts_in_use - 1, __ATOMIC_RELAXED);
+}
+
+static void connection_context_reset(Connection_Context *context, Buffer_Pool *pool) {
+    arena_reset(context->arena);
+    arena_reset(context->output_arenas[0]);
+    arena_reset(context->output_arenas[1]);
+    context->output_chunks[0] = 0;
+    context->output_chunks[1] = 0;
+    context->output_arena = 0;
+    // un contexto que se libero abortando puede haber quedado con salida encolada
+    context->first_output = NULL;
+    context->last_output = NULL;
+    context->output_size = 0;
+    context->sends_in_flight = 0;
+    request_init(&context->request);
+    parser_init(&context->parser, context->arena, pool);
 }
 
 /*
- * Agrega la lista enlazada de segmentos al arbol de segmentos.
- * Este arbol no es binario, sino que cada nodo puede tener multiples hijos.
- * Con lo cual se comparan los nodos del arbol con los de la lista enlazada hasta
- * encontrar el ancestro en comun mas reciente.
- * Una vez encontrado se agregan los nodos restantes al arbol.
- *
- * De:
- * 
- *          Arbol       Lista Enlazada
- *           (A)            (A)->(B)->(D)
- *          /   \
- *        (B)   (C)
- *
- *
- * A:
- *          Arbol       
- *           (A)     
- *          /   \
- *        (B)   (C)
- *        /
- *      (D)
- *
+ * Prepara el contexto para el proximo request de una conexion keep-alive.
+ * La respuesta anterior ya esta codificada en output_arenas, asi que la
+ * arena del request se reinicia entera. De los buffers solo quedan los
+ * que tienen bytes que el cliente mando despues (pipelining).
  */
-static void patterns_tree_add(Segment_Pattern **tree, Segment_Pattern *segment) {
+static void connection_context_next_request(Connection_Context *context) {
+    Parser *parser = &context->parser;
 
-    Segment_Pattern *server_segment = NULL;
+    request_init(&context->request);
+    arena_reset(context->arena);
 
-    for (server_segment = *tree;
-         server_segment != NULL;
-         server_segment = server_segment->next_segment) {
+    parser_next_request(parser);
+    parser_recycle_buffers(parser);
+}
 
-        if (string_eq(server_segment->segment, segment->segment) &&
-                server_segment->is_path_param == segment->is_path_param) {
-            break;
-        }
+/*
+ * Sin request a medias, sin bytes por parsear y sin nada por enviar: la
+ * conexion puede devolver el contexto.
+ */
+static bool connection_context_idle(Connection_Context *context) {
+    return context->parser.state == PARSER_STATE_STARTED &&
+           context->first_output == NULL &&
+           context->sends_in_flight == 0 &&
+           !parser_has_input(&context->parser);
+}
 
+/*
+ * Lee del socket hasta EAGAIN, atiende los requests y escribe las respuestas.
+ * Por cada read se atienden todos los requests completos que trajo y las
+ * respuestas salen juntas en un solo writev.
+ * Mientras haya mas salida pendiente que el high water mark no se leen
+ * requests nuevos: un cliente que no lee sus respuestas no puede hacer que
+ * el server acumule memoria sin limite.
+ * Devuelve true si hay que cerrar la conexion.
+ */
+static bool worker_handle_connection(Worker *worker, Connection *connection) {
+    if (connection->context == NULL) {
+        worker_attach_context(worker, connection);
     }
 
-    if (server_segment) {
+    Connection_Context *context = connection->context;
+    Parser *parser = &context->parser;
 
-        if (segment->child_segments) {
+    while (true) {
 
-            if (server_segment->child_segments) {
-                patterns_tree_add(&server_segment->child_segments, segment->child_segments);
-            } else {
-                server_segment->child_segments = segment->child_segments;
-            }
+        // primero lo que haya quedado sin atender de un read anterior
+        if (connection_process_input(worker, connection)) {
+            return true;
+        }
 
-        } else {
+        if (connection_flush_output(connection) == -1) {
+            return true;
+        }
 
-            if (server_segment->handler) {
-                panic_with_msg("http_server_handle failed due tu duplicated paths");
-            } else {
-                server_segment->handler = segment->handler;
-            }
+        if (context->output_size > worker->server->output_high_water_mark || connection->waiting_offload) {
+            break;
+        }
 
+        // el high water mark corto antes de tiempo pero el writev ya vacio la cola
+        if (parser_has_input(parser)) {
+            continue;
         }
-        
-    } else {
 
-        if (*tree == NULL) {
-            *tree = segment;
-        } else {
-            (*tree)->last_segment->next_segment = segment;
-            (*tree)->last_segment = segment;
+        Parser_Buffer *buffer = parser_read_buffer(parser);
+        if (buffer == NULL) {
+            printf("[ERROR] worker_handle_connection - request demasiado grande\n");
+            return true;
         }
-    
+
+        i64 bytes_read = read(connection->fd, buffer->data + buffer->used, buffer->size - buffer->used);
+        if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                return true;
+            }
+        } else if (bytes_read == 0) {
+            return true;
+        }
+
+        buffer->used += bytes_read;
+    }
+
+    worker_update_interest(worker, connection);
+
+    // Si no quedo ningun request a medias ni nada por enviar, la conexion
+    // vuelve a estar ociosa y no necesita el contexto.
+    if (connection_context_idle(context)) {
+        worker_detach_context(worker, connection);
     }
+
+    return false;
 }
 
-static Http_Handler *find_handler_while_adding_path_params(Segment_Pattern **request_patterns,
-                                                           Segment_Pattern *server_patterns) {
+/*
+ * El socket tiene lugar de nuevo: se sigue con la salida pendiente y, si
+ * bajo del high water mark, se retoma la lectura que se habia frenado.
+ * Devuelve true si hay que cerrar la conexion.
+ */
+static bool worker_handle_writable(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
+    if (context == NULL) {
+        return false;
+    }
 
-    Http_Handler *handler = NULL;
-    Segment_Pattern *request_pattern = *request_patterns;
+    if (connection_flush_output(connection) == -1) {
+        connection->state = CONNECTION_STATE_FAILED;
+        return true;
+    }
 
-    for (Segment_Pattern *server_pattern = server_patterns->first_segment;
-         server_pattern != NULL;
-         server_pattern = server_pattern->next_segment) {
+    // el cliente esta leyendo las respuestas, no esta ocioso
+    if (connection->timeout_kind == TIMEOUT_KIND_IDLE) {
+        connection->timeout_kind = TIMEOUT_KIND_NONE;
+    }
 
-        if (!server_pattern->is_path_param && 
-                string_eq(server_pattern->segment, request_pattern->segment)) {
+    if (connection->state == CONNECTION_STATE_CLOSING) {
+        return context->first_output == NULL;
+    }
 
-            if (!request_pattern->next_segment) {
+    bool reading_paused = !(connection->events_interest & EVENTS_INTEREST_READ);
+    if (reading_paused && !connection->waiting_offload &&
+            context->output_size <= worker->server->output_high_water_mark) {
+        // en modo edge-triggered no va a llegar otro aviso por lo que ya
+        // esta en el socket, asi que se lee ahora
+        return worker_handle_connection(worker, connection);
+    }
 
-                if (server_pattern->handler) {
-                    handler = server_pattern->handler;
-                    request_pattern->is_path_param = false;
-                }
+    worker_update_interest(worker, connection);
 
-            } else if (server_pattern->child_segments) {
+    if (connection_context_idle(context)) {
+        worker_detach_context(worker, connection);
+    }
 
-                handler = find_handler_while_adding_path_params(&request_pattern->next_segment,
-                                                                server_pattern->child_segments);
-                if (handler) {
-                    request_pattern->is_path_param = false;
-                }
-                
-            }
+    return false;
+}
 
-            break;
+/*
+ * Lee mientras la salida pendiente este por debajo del high water mark y
+ * pide EPOLLOUT mientras quede algo por escribir.
+ */
+static void worker_update_interest(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
 
-        } else if (server_pattern->is_path_param) {
+    u32 interest = 0;
 
-            if (!request_pattern->next_segment) {
+    if (connection->state == CONNECTION_STATE_ACTIVE && !connection->waiting_offload &&
+        (context == NULL || context->output_size <= worker->server->output_high_water_mark)) {
+        interest |= EVENTS_INTEREST_READ;
+    }
 
-                if (server_pattern->handler) {
-                    handler = server_pattern->handler;
-                    request_pattern->path_param_name = server_pattern->segment;
-                    request_pattern->is_path_param = true;
-                }
+    if (context && context->first_output != NULL) {
+        interest |= EVENTS_INTEREST_WRITE;
+    }
 
-            } else if (server_pattern->child_segments) {
+    if (interest != connection->events_interest) {
+        events_modify_fd(worker->events_fd, connection->fd, connection,
+                         worker->events_flags, connection->events_interest, interest);
+        connection->events_interest = interest;
+    }
+}
 
-                if (!handler) {
+/*
+ * Antes de cerrar se intenta mandar lo que quedo encolado (por ejemplo la
+ * respuesta a un request con "Connection: close"). Si el socket esta lleno
+ * la conexion queda cerrandose hasta que se vacie la cola.
+ */
+static void worker_close_connection(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
 
-                    handler = find_handler_while_adding_path_params(&request_pattern->next_segment,
-                                                                    server_pattern->child_segments);
-                    if (handler) {
-                        request_pattern->path_param_name = server_pattern->segment;
-                        request_pattern->is_path_param = true;
-                    }
+    // el pool todavia usa el contexto: la libera worker_finish_offload
+    if (connection->waiting_offload) {
+        worker_abort_connection(worker, connection);
+        return;
+    }
 
-                }
-            }
+    if (connection->state == CONNECTION_STATE_ACTIVE && context && context->first_output) {
+        if (connection_flush_output(connection) == 0 && context->first_output) {
+            connection->state = CONNECTION_STATE_CLOSING;
+            worker_update_interest(worker, connection);
+            return;
         }
     }
 
-    return handler;
+    events_remove_fd(worker->events_fd, connection->fd);
+    worker_detach_context(worker, connection);
+    worker_release_connection(worker, connection);
 }
 
-static i32 connection_write(Connection *connection, Response response) {
-    Arena *arena = connection->arena;
+/*
+ * Elige el timeout segun en que parte del request esta la conexion. Si no
+ * cambio no hace nada: el deadline de los headers y del body corre desde
+ * que empezaron a llegar, no desde el ultimo read.
+ */
+static void worker_update_timeout(Worker *worker, Connection *connection) {
+    if (connection->state == CONNECTION_STATE_FAILED) {
+        return;
+    }
 
-    String content_lenght_value = string_from_i64(arena, response.body.size);
-    String connection_value;
+    Server *server = worker->server;
+    Connection_Context *context = connection->context;
 
-    if (connection->keep_alive) {
-        connection_value = string_lit("keep-alive");
-    } else {
-        connection_value = string_lit("close");
+    Timeout_Kind kind = TIMEOUT_KIND_IDLE;
+    u32 timeout_ms = server->idle_timeout_ms;
+
+    if (context && connection->state == CONNECTION_STATE_ACTIVE) {
+        Parser_State state = context->parser.state;
+
+        if (state >= PARSER_STATE_PARSING_BODY_BEGIN && state < PARSER_STATE_FINISHED) {
+            kind = TIMEOUT_KIND_BODY;
+            timeout_ms = server->body_timeout_ms;
+        } else if (state != PARSER_STATE_STARTED && state != PARSER_STATE_FINISHED) {
+            kind = TIMEOUT_KIND_HEADERS;
+            timeout_ms = server->headers_timeout_ms;
+        }
     }
 
-    headers_put(&response.headers, string_lit("Content-Length"), content_lenght_value);
-    headers_put(&response.headers, string_lit("Connection"), connection_value);
+    if (kind == connection->timeout_kind) {
+        return;
+    }
 
-    String encoded_response = encode_response(arena, response);
+    connection->timeout_kind = kind;
 
-    // TODO: Esto deberia estar en un loop por temas de escritura parcial
-    i32 bytes_sent = write(connection->fd, encoded_response.data, encoded_response.size);
+    Timer_Wheel *wheel = &worker->timers;
 
-    if (bytes_sent == -1) {
-        printf("[ERROR] connection_write - error al escribir en la conexion\n");
-        return -1;
+    // un timeout en 0 esta desactivado: la conexion no va al wheel, asi
+    // avanzar los ticks no la tiene que recorrer y reinsertar
+    if (timeout_ms == 0) {
+        timer_wheel_remove(wheel, connection);
+        return;
     }
 
-    if (bytes_sent != encoded_response.size) {
-        printf("[ERROR] connection_write - escritura parcial\n");
-        return -1;
+    // current_tick puede estar atrasado hasta un tick, por eso el + 1
+    u32 deadline = wheel->current_tick + (timeout_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS + 1;
+
+    // Si el deadline se aleja alcanza con anotarlo, el slot lo reinserta
+    // cuando le toque. Si se acerca hay que moverla a un slot anterior.
+    bool in_wheel = connection->timer_pprev != NULL;
+    if (in_wheel && deadline < connection->timer_deadline) {
+        timer_wheel_remove(wheel, connection);
+        in_wheel = false;
     }
 
-    return 0;
-}
+    connection->timer_deadline = deadline;
 
-static String encode_response(Arena *arena, Response response) {
-    String line_separator = string_lit("\r\n");
-    String colon_separator = string_lit(": ");
-    String space_separator = string_lit(" ");
+    if (!in_wheel) {
+        timer_wheel_insert(wheel, connection);
+    }
+}
 
-    String version = string_lit("HTTP/1.1 ");
-    String status = string_from_i64(arena, response.status);
-    String status_description = http_status_reason(response.status);
-    String body = string_with_len((char *)response.body.data, response.body.size);
+/*
+ * Avanza el wheel hasta el tick actual y cierra las conexiones vencidas.
+ */
+static void worker_expire_timers(Worker *worker) {
+    Timer_Wheel *wheel = &worker->timers;
 
-    // calculo de capacidad
-    u32 response_minimum_size = version.size +
-        status.size +
-        status_description.size +
-        body.size +
-        1 + 2 + 2; // space + first line \r\n + headers \r\n
+    u32 now_tick = (u32)((monotonic_ms() - wheel->start_ms) / TIMER_WHEEL_TICK_MS);
 
-    for (u32 i = 0; i < MAX_HEADERS_CAPACITY; i++) {
-        Header header = response.headers.headers[i];
-        if (header.occupied) {
-            // + 4 por colon + salto de linea (2 c/u)
-            response_minimum_size += header.field_name.size + header.field_value.size + 4;
-        }
+    if (wheel->timers_count == 0) {
+        wheel->current_tick = now_tick;
+        return;
     }
 
-    String_Builder builder = {0};
-    sbuilder_init_cap(&builder, arena, response_minimum_size);
-    sbuilder_append(&builder, version);
-    sbuilder_append(&builder, status);
-    sbuilder_append(&builder, space_separator);
-    sbuilder_append(&builder, status_description);
-    sbuilder_append(&builder, line_separator);
+    while (wheel->current_tick != now_tick) {
+        wheel->current_tick++;
 
-    for (u32 i = 0; i < MAX_HEADERS_CAPACITY; i++) {
-        Header header = response.headers.headers[i];
-        if (header.occupied) {
-            sbuilder_append(&builder, header.field_name);
-            sbuilder_append(&builder, colon_separator);
-            sbuilder_append(&builder, header.field_value);
-            sbuilder_append(&builder, line_separator);
+        Connection **slot = &wheel->slots[wheel->current_tick & (TIMER_WHEEL_SLOTS - 1)];
+        Connection *connection = *slot;
+        *slot = NULL;
+
+        while (connection != NULL) {
+            Connection *next = connection->timer_next;
+
+            connection->timer_next = NULL;
+            connection->timer_pprev = NULL;
+            wheel->timers_count--;
+
+            if (connection->timer_deadline <= wheel->current_tick) {
+                worker_abort_connection(worker, connection);
+            } else {
+                timer_wheel_insert(wheel, connection);
+            }
+
+            connection = next;
         }
     }
+}
 
-    sbuilder_append(&builder, line_separator);
+/*
+ * Cierra la conexion sin mandar lo que tenga pendiente (vencio un timeout
+ * o se corto del otro lado).
+ */
+static void worker_abort_connection(Worker *worker, Connection *connection) {
+    connection->state = CONNECTION_STATE_FAILED;
+
+#if OS_LINUX
+    if (worker->backend == EVENTS_BACKEND_IO_URING) {
+        // hace que terminen el recv y los sends en vuelo
+        shutdown(connection->fd, SHUT_RDWR);
+        uring_close_connection(worker, connection);
+        return;
+    }
+#endif
 
-    if (response.body.size > 0) {
-        sbuilder_append(&builder, body);
+    events_remove_fd(worker->events_fd, connection->fd);
+    connection->fd = -1;
+
+    // si el handler sigue en el pool la conexion se libera cuando vuelva
+    if (connection->waiting_offload) {
+        return;
     }
 
-    return sbuilder_to_string(&builder);
+    worker_detach_context(worker, connection);
+    worker_release_connection(worker, connection);
 }
 
-static i32 events_add_fd(i32 events_fd, i32 fd) {
+/*
+ * Atiende los jobs de offload que ya terminaron. Los threads del pool los
+ * apilan, asi que se da vuelta la pila para responder en el orden en que
+ * terminaron.
+ */
+static void worker_drain_offload(Worker *worker) {
+    Offload_Job *stack = __atomic_exchange_n(&worker->completed_jobs, NULL, __ATOMIC_ACQUIRE);
+
+    Offload_Job *jobs = NULL;
+    while (stack != NULL) {
+        Offload_Job *next = stack->next;
+        stack->next = jobs;
+        jobs = stack;
+        stack = next;
+    }
+
+    while (jobs != NULL) {
+        // el job vive en la arena de la conexion, que se puede reusar al terminar
+        Offload_Job *next = jobs->next;
+        worker_finish_offload(worker, jobs);
+        jobs = next;
+    }
+}
+
+/*
+ * Encola la respuesta que armo el pool y sigue con la conexion como si el
+ * handler hubiera corrido en el event loop, incluidos los requests pipelined
+ * que llegaron detras del que se mando al pool.
+ */
+static void worker_finish_offload(Worker *worker, Offload_Job *job) {
+    Connection *connection = job->connection;
+    Connection_Context *context = connection->context;
+
+    connection->waiting_offload = false;
+
+    // el pool la codifico en la arena del request, que se reinicia al pasar al proximo
+    String output = string_sub(connection_output_arena(context), &job->output, 0, job->output.size - 1);
+
+#if OS_LINUX
+    if (worker->backend == EVENTS_BACKEND_IO_URING) {
+        if (connection->state != CONNECTION_STATE_ACTIVE) {
+            uring_close_connection(worker, connection);
+            return;
+        }
+
+        connection_push_output(context, output);
+
+        if (!connection->keep_alive) {
+            uring_close_connection(worker, connection);
+            return;
+        }
+
+        connection_context_next_request(context);
+
+        if (connection_process_input(worker, connection)) {
+            uring_close_connection(worker, connection);
+            return;
+        }
+
+        uring_flush_output(worker, connection);
+
+        if (context->output_size <= worker->server->output_high_water_mark) {
+            uring_resume_recv(worker, connection);
+        }
+
+        worker_update_timeout(worker, connection);
+        return;
+    }
+#endif
+
+    if (connection->state != CONNECTION_STATE_ACTIVE) {
+        if (connection->fd != -1) {
+            events_remove_fd(worker->events_fd, connection->fd);
+        }
+        worker_detach_context(worker, connection);
+        worker_release_connection(worker, connection);
+        return;
+    }
+
+    connection_push_output(context, output);
+
+    if (!connection->keep_alive) {
+        worker_close_connection(worker, connection);
+        return;
+    }
+
+    connection_context_next_request(context);
+
+    if (connection_process_input(worker, connection)) {
+        worker_close_connection(worker, connection);
+        return;
+    }
+
+    if (connection_flush_output(connection) == -1) {
+        worker_abort_connection(worker, connection);
+        return;
+    }
+
+    // vuelve a escuchar EPOLLIN; si llego algo mientras tanto avisa de nuevo
+    worker_update_interest(worker, connection);
+    worker_update_timeout(worker, connection);
+}
+
+/*
+ * Levanta los threads del pool de offload. Se llama con SIGINT bloqueada,
+ * asi los threads la heredan y la signal siempre cae en el thread principal.
+ */
+static i32 offload_pool_start(Server *server) {
+    Offload_Pool *pool = &server->offload;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_jobs, NULL);
+
+    for (u32 i = 0; i < pool->threads_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, &offload_thread_run, server) != 0) {
+            return -1;
+        }
+        pool->threads_started++;
+    }
+
+    return 0;
+}
+
+static void offload_pool_stop(Server *server) {
+    Offload_Pool *pool = &server->offload;
+    if (pool->threads_started == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->has_jobs);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (u32 i = 0; i < pool->threads_started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
+
+/*
+ * Manda el request actual de la conexion al pool. Devuelve false si la
+ * cola esta llena.
+ */
+static bool offload_submit(Worker *worker, Connection *connection, Http_Handler *handler) {
+    Offload_Pool *pool = &worker->server->offload;
+
+    Offload_Job *job = arena_alloc(connection->context->arena, sizeof(Offload_Job));
+    job->worker = worker;
+    job->connection = connection;
+    job->handler = handler;
+    job->queued_ns = monotonic_ns();
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->stats.queue_depth >= OFFLOAD_QUEUE_CAPACITY) {
+        pool->stats.jobs_rejected++;
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+
+    if (pool->last_job == NULL) {
+        pool->first_job = job;
+    } else {
+        pool->last_job->next = job;
+    }
+    pool->last_job = job;
+
+    pool->stats.queue_depth++;
+    if (pool->stats.queue_depth > pool->stats.max_queue_depth) {
+        pool->stats.max_queue_depth = pool->stats.queue_depth;
+    }
+
+    pthread_cond_signal(&pool->has_jobs);
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+/*
+ * Corre el handler y deja la respuesta codificada en la arena de la
+ * conexion. El worker no toca esa conexion hasta que el job vuelve.
+ */
+static void *offload_thread_run(void *data) {
+    Server *server = (Server *)data;
+    Offload_Pool *pool = &server->offload;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->first_job == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->has_jobs, &pool->lock);
+        }
+
+        Offload_Job *job = pool->first_job;
+        if (job == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        pool->first_job = job->next;
+        if (pool->first_job == NULL) {
+            pool->last_job = NULL;
+        }
+
+        u64 wait_ns = monotonic_ns() - job->queued_ns;
+        pool->stats.queue_depth--;
+        pool->stats.total_wait_ns += wait_ns;
+        if (wait_ns > pool->stats.max_wait_ns) {
+            pool->stats.max_wait_ns = wait_ns;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        Connection *connection = job->connection;
+
+        Response response;
+        response_init(&response);
+
+        job->handler(&connection->context->request, &response);
+
+        job->output = connection_encode_response(connection->context->arena, connection, response);
+
+        __atomic_fetch_add(&pool->stats.jobs_completed, 1, __ATOMIC_RELAXED);
+
+        // Pila lock-free de completados del worker. Solo hace falta
+        // despertarlo si estaba vacia: si no, ya hay un aviso pendiente.
+        Worker *worker = job->worker;
+        Offload_Job *head = __atomic_load_n(&worker->completed_jobs, __ATOMIC_RELAXED);
+        do {
+            job->next = head;
+        } while (!__atomic_compare_exchange_n(&worker->completed_jobs, &head, job, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+        if (head == NULL) {
+            worker_wakeup(worker);
+        }
+    }
+
+    return NULL;
+}
+
+static u64 monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static u64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void timer_wheel_init(Timer_Wheel *wheel) {
+    *wheel = (Timer_Wheel){0};
+    wheel->start_ms = monotonic_ms();
+}
+
+static void timer_wheel_insert(Timer_Wheel *wheel, Connection *connection) {
+    u32 ticks = connection->timer_deadline - wheel->current_tick;
+    if (connection->timer_deadline <= wheel->current_tick) {
+        ticks = 1;
+    } else if (ticks >= TIMER_WHEEL_SLOTS) {
+        ticks = TIMER_WHEEL_SLOTS - 1;
+    }
+
+    Connection **slot = &wheel->slots[(wheel->current_tick + ticks) & (TIMER_WHEEL_SLOTS - 1)];
+
+    connection->timer_next = *slot;
+    connection->timer_pprev = slot;
+    if (*slot) {
+        (*slot)->timer_pprev = &connection->timer_next;
+    }
+    *slot = connection;
+
+    wheel->timers_count++;
+}
+
+static void timer_wheel_remove(Timer_Wheel *wheel, Connection *connection) {
+    if (connection->timer_pprev == NULL) {
+        return;
+    }
+
+    *connection->timer_pprev = connection->timer_next;
+    if (connection->timer_next) {
+        connection->timer_next->timer_pprev = connection->timer_pprev;
+    }
+
+    connection->timer_next = NULL;
+    connection->timer_pprev = NULL;
+    wheel->timers_count--;
+}
+
+/*
+ * Parsea los bytes pendientes del parser y atiende en orden cada request que
+ * se complete (pipelining). No importa de donde vinieron los bytes (read o
+ * io_uring). Si un handler se va al pool o la salida pasa el high water mark
+ * se corta, y lo que sigue queda en los buffers para la proxima llamada.
+ * Devuelve true si hay que cerrar la conexion.
+ */
+static bool connection_process_input(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
+    Parser *parser = &context->parser;
+    Request *request = &context->request;
+
+    while (!connection->waiting_offload &&
+           context->output_size <= worker->server->output_high_water_mark &&
+           parser_has_input(parser)) {
+
+        parser_parse_request(parser, request);
+
+        if (parser->body_chunk.size > 0) {
+            context->route->body_handler(request, (u8 *)parser->body_chunk.data, parser->body_chunk.size);
+            parser->body_chunk = (String){0};
+        }
+
+        // el tamanio de un body chunked recien se sabe a medida que llega
+        if (parser->body_chunked && !parser->body_streaming && parser->body_parsed > MAX_BODY_SIZE) {
+            connection_reject_body(connection);
+            return true;
+        }
+
+        if (parser->state == PARSER_STATE_HEADERS_FINISHED) {
+            if (connection_begin_body(worker, connection)) {
+                return true;
+            }
+        } else if (parser->state == PARSER_STATE_FINISHED) {
+            // se completo un request: el proximo timeout arranca de cero
+            connection->timeout_kind = TIMEOUT_KIND_NONE;
+
+            // si tenia body la ruta ya se busco al terminar los headers
+            bool has_body = parser->body_size > 0 || parser->body_chunked;
+            Route *route = has_body ? context->route : server_find_route(worker->server, request);
+            Http_Handler *handler = route ? route->handler : NULL;
+
+            if (request->connection == CONNECTION_TOKEN_NONE) {
+                connection->keep_alive = string_eq(request->version, HTTP_VERSION_11);
+            } else {
+                connection->keep_alive = request->connection == CONNECTION_TOKEN_KEEP_ALIVE;
+            }
+        
+            if (route && (route->handler_flags & HANDLER_FLAG_BLOCKING)) {
+                if (offload_submit(worker, connection, handler)) {
+                    // la respuesta la encola worker_finish_offload
+                    connection->waiting_offload = true;
+                    return false;
+                }
+            }
+
+            Response response;
+            response_init(&response);
+
+            if (route && (route->handler_flags & HANDLER_FLAG_BLOCKING)) {
+                // la cola del pool esta llena
+                http_response_set_status(&response, 503);
+            } else if (handler) {
+                handler(request, &response);
+            } else {
+                http_response_set_status(&response, 404);
+            }
+        
+            connection_write(connection, response);
+
+            if (!connection->keep_alive) {
+                return true;
+            }
+
+            connection_context_next_request(context);
+
+        } else if (parser->state == PARSER_STATE_FAILED) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Terminaron los headers de un request con body. Se busca la ruta antes de
+ * leerlo para saber si va en streaming o se junta en request->body, y si
+ * el cliente espera el "100 Continue" se le manda una sola vez aca.
+ * Devuelve true si hay que cerrar la conexion.
+ */
+static bool connection_begin_body(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
+    Parser *parser = &context->parser;
+    Request *request = &context->request;
+
+    context->route = server_find_route(worker->server, request);
+
+    bool streaming = context->route && context->route->body_handler;
+
+    if (!streaming && parser->body_size > MAX_BODY_SIZE) {
+        connection_reject_body(connection);
+        return true;
+    }
+
+    if (request->expect_continue) {
+        Response response;
+        response_init(&response);
+        http_response_set_status(&response, 100);
+
+        connection_write(connection, response);
+    }
+
+    parser_begin_body(parser, streaming);
+
+    return false;
+}
+
+/*
+ * El body no entra en request->body. Se contesta 413 y se cierra: el resto
+ * del body ya esta en camino y no se va a leer.
+ */
+static void connection_reject_body(Connection *connection) {
+    Response response;
+    response_init(&response);
+    http_response_set_status(&response, 413);
+
+    connection->keep_alive = false;
+    connection_write(connection, response);
+}
+
+static Route *server_find_route(Server *server, Request *request) {
+    Route *route = server_find_method_route(server, request, request->method);
+
+    // un HEAD sin ruta propia usa la del GET: connection_encode_response
+    // manda los mismos headers pero no el body
+    if (route == NULL && request->method == HTTP_METHOD_HEAD) {
+        route = server_find_method_route(server, request, HTTP_METHOD_GET);
+    }
+
+    return route;
+}
+
+static Route *server_find_method_route(Server *server, Request *request, Http_Method method) {
+    Router *router = &server->routers[method];
+
+    // las formas authority y asterisk no tienen path
+    if (router->nodes_count == 0 || request->route_path.size == 0) {
+        return NULL;
+    }
+
+    request->path_params_count = 0;
+
+    request->route = static_routes_find(&server->static_routes, method, request->route_path);
+    if (request->route) {
+        return request->route;
+    }
+
+    // las aristas del trie no tienen la '/' del principio
+    request->route = router_match(router, 0, request, 1);
+
+    if (request->route == NULL) {
+        request->path_params_count = 0;
+    }
+
+    return request->route;
+}
+
+/*
+ * Arma un radix trie por metodo con las rutas registradas y lo compacta en
+ * server->routers. El trie se arma en una arena aparte que se libera al
+ * terminar; los routers quedan en la arena del server.
+ */
+static void server_freeze_routes(Server *server) {
+    if (server->routes_frozen) {
+        return;
+    }
+    server->routes_frozen = true;
+
+    // Cada segmento agrega como mucho tres nodos: el que parte, el nuevo y
+    // el param. Por ruta, la tabla de las estaticas usa unos 40 bytes.
+    u64 routes_count = 0;
+    u64 segments_count = 0;
+    for (Route *route = server->first_route; route != NULL; route = route->next) {
+        routes_count++;
+        for (Segment_Pattern *segment = route->first_segment; segment != NULL; segment = segment->next_segment) {
+            segments_count++;
+        }
+    }
+
+    Arena *builder_arena = arena_make((HTTP_METHODS_COUNT + segments_count * 3) * sizeof(Route_Builder_Node) +
+                                      routes_count * 64 + 1 * KB);
+
+    for (u32 method = 0; method < HTTP_METHODS_COUNT; method++) {
+        Route_Builder_Node *root = NULL;
+
+        for (Route *route = server->first_route; route != NULL; route = route->next) {
+            if (route->method != method) {
+                continue;
+            }
+
+            if (root == NULL) {
+                root = router_builder_node(builder_arena, string_lit(""));
+            }
+
+            router_builder_add(builder_arena, root, route);
+        }
+
+        if (root) {
+            router_compile(&server->routers[method], server->arena, root);
+        }
+    }
+
+    // despues de los routers, que ya rechazaron las rutas duplicadas
+    static_routes_build(&server->static_routes, server->arena, builder_arena, server->first_route);
+
+    arena_destroy(builder_arena);
+}
+
+static Route_Builder_Node *router_builder_node(Arena *arena, String prefix) {
+    Route_Builder_Node *node = arena_alloc(arena, sizeof(Route_Builder_Node));
+    *node = (Route_Builder_Node){0};
+    node->prefix = prefix;
+
+    return node;
+}
+
+/*
+ * Agrega una ruta al trie. Los bytes que se comparan son los del path sin
+ * la primera '/': los segmentos literales seguidos, con las '/' entre ellos,
+ * son una sola arista, que es una vista sobre el pattern. Un param es un
+ * nodo aparte, param_child del nodo donde termino el literal anterior, y
+ * un {*name} es la ruta catch_all de ese nodo.
+ *
+ * "GET /users/{id}/orders" queda como "users/", {id}, "/orders".
+ */
+static void router_builder_add(Arena *arena, Route_Builder_Node *root, Route *route) {
+    Route_Builder_Node *node = root;
+
+    const char *literal_start = NULL;
+    const char *literal_end = NULL;
+
+    for (Segment_Pattern *segment = route->first_segment; segment != NULL; segment = segment->next_segment) {
+        bool is_first = segment == route->first_segment;
+
+        if (!segment->is_path_param) {
+            // sin la '/' de adelante si es el primero
+            if (literal_start == NULL) {
+                literal_start = is_first ? segment->segment.data : segment->segment.data - 1;
+            }
+            literal_end = segment->segment.data + segment->segment.size;
+            continue;
+        }
+
+        // el literal llega hasta la '/' antes del '{', que es su ultimo byte
+        if (!is_first) {
+            const char *open_brace = segment->segment.data - 1 - segment->is_catch_all;
+            if (literal_start == NULL) {
+                literal_start = open_brace - 1;
+            }
+            literal_end = open_brace;
+        }
+
+        if (literal_start) {
+            node = router_builder_add_literal(arena, node, string_with_len(literal_start, literal_end - literal_start));
+            literal_start = NULL;
+        }
+
+        // el pattern parser no deja nada despues de un {*name}
+        if (segment->is_catch_all) {
+            if (node->catch_all) {
+                panic_with_msg("http_server_handle failed due to duplicated paths");
+            }
+            node->catch_all = route;
+            return;
+        }
+
+        if (node->param_child == NULL) {
+            node->param_child = router_builder_node(arena, string_lit(""));
+        }
+        node = node->param_child;
+    }
+
+    if (literal_start) {
+        node = router_builder_add_literal(arena, node, string_with_len(literal_start, literal_end - literal_start));
+    }
+
+    // "/users/{id}" y "/users/{name}" tambien son la misma ruta
+    if (node->route) {
+        panic_with_msg("http_server_handle failed due to duplicated paths");
+    }
+    node->route = route;
+}
+
+/*
+ * Baja por los hijos literales de node consumiendo literal y devuelve el
+ * nodo donde termina. Si literal se separa a mitad de la arista de un hijo,
+ * el hijo se parte en dos y la parte comun queda como un nodo intermedio.
+ */
+static Route_Builder_Node *router_builder_add_literal(Arena *arena, Route_Builder_Node *node, String literal) {
+
+    while (literal.size > 0) {
+
+        Route_Builder_Node **link = &node->first_child;
+        while (*link && (u8)(*link)->prefix.data[0] < (u8)literal.data[0]) {
+            link = &(*link)->next_sibling;
+        }
+
+        Route_Builder_Node *child = *link;
+
+        if (child == NULL || child->prefix.data[0] != literal.data[0]) {
+            Route_Builder_Node *new_child = router_builder_node(arena, literal);
+            new_child->next_sibling = child;
+            *link = new_child;
+            return new_child;
+        }
+
+        u32 common = 1;
+        while (common < child->prefix.size && common < literal.size &&
+               child->prefix.data[common] == literal.data[common]) {
+            common++;
+        }
+
+        if (common < child->prefix.size) {
+            Route_Builder_Node *middle = router_builder_node(arena, string_with_len(child->prefix.data, common));
+            middle->next_sibling = child->next_sibling;
+            middle->first_child = child;
+
+            child->next_sibling = NULL;
+            child->prefix = string_with_len(child->prefix.data + common, child->prefix.size - common);
+
+            *link = middle;
+            child = middle;
+        }
+
+        node = child;
+        literal = string_with_len(literal.data + common, literal.size - common);
+    }
+
+    return node;
+}
+
+/*
+ * Compacta el trie en los arrays de router. Primero se mide todo para
+ * reservar cada array de una vez, despues se llena recorriendo el trie.
+ */
+static void router_compile(Router *router, Arena *arena, Route_Builder_Node *root) {
+    *router = (Router){0};
+    router_measure(router, root);
+
+    router->nodes = arena_alloc(arena, sizeof(Route_Node) * router->nodes_count);
+    router->bytes = arena_alloc(arena, router->bytes_count + 1);
+    router->first_bytes = arena_alloc(arena, router->children_count + 1);
+    router->children = arena_alloc(arena, sizeof(u32) * (router->children_count + 1));
+    router->jump_tables = arena_alloc(arena, 256 * router->jump_tables_count + 1);
+
+    router->nodes_count = 0;
+    router->bytes_count = 0;
+    router->children_count = 0;
+    router->jump_tables_count = 0;
+
+    router_compile_node(router, root);
+}
+
+static void router_measure(Router *router, Route_Builder_Node *node) {
+    router->nodes_count++;
+    router->bytes_count += node->prefix.size;
+
+    u32 children_count = 0;
+    for (Route_Builder_Node *child = node->first_child; child != NULL; child = child->next_sibling) {
+        router_measure(router, child);
+        children_count++;
+    }
+
+    router->children_count += children_count;
+    if (children_count >= ROUTER_JUMP_TABLE_MIN_CHILDREN) {
+        router->jump_tables_count++;
+    }
+
+    if (node->param_child) {
+        router_measure(router, node->param_child);
+    }
+}
+
+static u32 router_compile_node(Router *router, Route_Builder_Node *builder_node) {
+    u32 index = router->nodes_count++;
+    Route_Node *node = &router->nodes[index];
+
+    node->prefix_start = router->bytes_count;
+    node->prefix_size = builder_node->prefix.size;
+    memcpy(router->bytes + router->bytes_count, builder_node->prefix.data, builder_node->prefix.size);
+    router->bytes_count += builder_node->prefix.size;
+
+    node->route = builder_node->route;
+    node->catch_all = builder_node->catch_all;
+
+    u16 children_count = 0;
+    for (Route_Builder_Node *child = builder_node->first_child; child != NULL; child = child->next_sibling) {
+        children_count++;
+    }
+
+    // los hijos de un nodo quedan juntos, se reservan antes de bajar
+    node->children_start = router->children_count;
+    node->children_count = children_count;
+    router->children_count += children_count;
+
+    node->jump_table = 0;
+    u8 *jump_table = NULL;
+    if (children_count >= ROUTER_JUMP_TABLE_MIN_CHILDREN) {
+        jump_table = router->jump_tables + 256 * router->jump_tables_count;
+        memset(jump_table, 0, 256);
+        node->jump_table = ++router->jump_tables_count;
+    }
+
+    u32 i = 0;
+    for (Route_Builder_Node *child = builder_node->first_child; child != NULL; child = child->next_sibling) {
+        u8 first_byte = child->prefix.data[0];
+
+        router->first_bytes[node->children_start + i] = first_byte;
+        router->children[node->children_start + i] = router_compile_node(router, child);
+
+        if (jump_table) {
+            jump_table[first_byte] = i + 1;
+        }
+
+        i++;
+    }
+
+    node->param_child = builder_node->param_child ? router_compile_node(router, builder_node->param_child) : 0;
+
+    return index;
+}
+
+/*
+ * Busca la ruta de request->route_path a partir de at, bajando por el trie
+ * desde node_index. Los params quedan en request->path_params como
+ * posiciones en el path, sin copiar nada.
+ *
+ * Un {*name} va ultimo: solo se usa si ninguna bajada, ni por los literales
+ * ni por los params, llega a una ruta. De los que se cruzaron gana el que
+ * arranca mas adelante en el path, con el resto del path como param.
+ */
+static Route *router_match(Router *router, u32 node_index, Request *request, u32 at) {
+    Catch_All_Match catch_all;
+    catch_all.route = NULL;
+
+    Route *route = router_descend(router, node_index, request, at, &catch_all);
+    if (route || catch_all.route == NULL) {
+        return route;
+    }
+
+    request->path_params_count = catch_all.path_params_count;
+    memcpy(request->path_params, catch_all.path_params, sizeof(Path_Param) * catch_all.path_params_count);
+
+    // el resto del path entero, con sus '/', aunque este vacio
+    Path_Param *param = &request->path_params[request->path_params_count++];
+    param->offset = catch_all.at;
+    param->size = request->route_path.size - catch_all.at;
+    param->is_decoded = false;
+
+    return catch_all.route;
+}
+
+/*
+ * Un literal tiene prioridad sobre un param: si se puede seguir por los
+ * dos, primero se prueba el literal y si no llega a ninguna ruta se vuelve
+ * a probar con el param. Si no hay param no hay nada que volver a probar y
+ * se sigue en el mismo loop. Los {*name} que cruza no los devuelve, los
+ * anota en catch_all para que router_match decida al final.
+ */
+static Route *router_descend(Router *router, u32 node_index, Request *request, u32 at, Catch_All_Match *catch_all) {
+    String path = request->route_path;
+
+    for (;;) {
+
+        Route_Node *node = &router->nodes[node_index];
+
+        if (node->prefix_size > path.size - at ||
+                memcmp(path.data + at, router->bytes + node->prefix_start, node->prefix_size) != 0) {
+            return NULL;
+        }
+        at += node->prefix_size;
+
+        if (at == path.size && node->route) {
+            return node->route;
+        }
+
+        // con empate se queda el primero, que vino por un literal
+        if (node->catch_all && (catch_all->route == NULL || at > catch_all->at)) {
+            catch_all->route = node->catch_all;
+            catch_all->at = at;
+            catch_all->path_params_count = request->path_params_count;
+            memcpy(catch_all->path_params, request->path_params, sizeof(Path_Param) * request->path_params_count);
+        }
+
+        u32 literal_child = at == path.size ? 0 : router_find_child(router, node, path.data[at]);
+
+        if (node->param_child == 0) {
+            if (literal_child == 0) {
+                return NULL;
+            }
+            node_index = literal_child;
+            continue;
+        }
+
+        if (literal_child) {
+            u32 params_count = request->path_params_count;
+
+            Route *route = router_descend(router, literal_child, request, at, catch_all);
+            if (route) {
+                return route;
+            }
+
+            request->path_params_count = params_count;
+        }
+
+        // un param siempre empieza en un segmento y se lo come entero, aunque este vacio
+        const char *slash = memchr(path.data + at, '/', path.size - at);
+        u32 end = slash ? (u32)(slash - path.data) : path.size;
+
+        Path_Param *param = &request->path_params[request->path_params_count++];
+        param->offset = at;
+        param->size = end - at;
+        param->is_decoded = false;
+
+        at = end;
+        node_index = node->param_child;
+    }
+}
+
+static u32 router_find_child(Router *router, Route_Node *node, u8 c) {
+    if (node->jump_table) {
+        u8 position = router->jump_tables[256 * (node->jump_table - 1) + c];
+        return position ? router->children[node->children_start + position - 1] : 0;
+    }
+
+    u8 *first_bytes = router->first_bytes + node->children_start;
+    for (u32 i = 0; i < node->children_count; i++) {
+        if (first_bytes[i] == c) {
+            return router->children[node->children_start + i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Arma la tabla de las rutas sin params. Hay el doble de slots que rutas y
+ * un bucket cada dos rutas; con esa holgura casi siempre alcanza la primera
+ * seed, y si no se prueba con la siguiente.
+ */
+static void static_routes_build(Static_Routes *table, Arena *arena, Arena *scratch, Route *first_route) {
+    *table = (Static_Routes){0};
+
+    u32 routes_count = 0;
+    u32 bytes_count = 0;
+    for (Route *route = first_route; route != NULL; route = route->next) {
+        if (route->path_params_count == 0) {
+            routes_count++;
+            bytes_count += route_static_path(route).size;
+        }
+    }
+
+    if (routes_count == 0) {
+        return;
+    }
+
+    u32 slots_count = 2;
+    while (slots_count < routes_count * 2) {
+        slots_count *= 2;
+    }
+
+    u32 buckets_count = 1;
+    while (buckets_count * 2 < routes_count) {
+        buckets_count *= 2;
+    }
+
+    table->slots = arena_alloc(arena, sizeof(Static_Route) * slots_count);
+    table->slots_mask = slots_count - 1;
+    table->displacements = arena_alloc(arena, sizeof(u32) * buckets_count);
+    table->buckets_mask = buckets_count - 1;
+    table->bytes = arena_alloc(arena, bytes_count);
+
+    Route **routes = arena_alloc(scratch, sizeof(Route *) * routes_count);
+    u64 *hashes = arena_alloc(scratch, sizeof(u64) * routes_count);
+    u32 *buckets_order = arena_alloc(scratch, sizeof(u32) * routes_count);
+    u32 *buckets_start = arena_alloc(scratch, sizeof(u32) * (buckets_count + 1));
+
+    u32 i = 0;
+    for (Route *route = first_route; route != NULL; route = route->next) {
+        if (route->path_params_count == 0) {
+            routes[i++] = route;
+        }
+    }
+
+    table->seed = 0;
+    while (!static_routes_place(table, routes, routes_count, hashes, buckets_order, buckets_start)) {
+        table->seed++;
+    }
+
+    // los paths se copian juntos, asi las comparaciones no saltan por los patterns
+    u32 bytes_used = 0;
+    for (u32 slot = 0; slot < slots_count; slot++) {
+        Static_Route *static_route = &table->slots[slot];
+        if (static_route->route == NULL) {
+            continue;
+        }
+
+        String path = route_static_path(static_route->route);
+        memcpy(table->bytes + bytes_used, path.data, path.size);
+
+        static_route->method = static_route->route->method;
+        static_route->path_start = bytes_used;
+        static_route->path_size = path.size;
+        bytes_used += path.size;
+
+        table->path_sizes |= 1ull << (path.size < 63 ? path.size : 63);
+    }
+}
+
+/*
+ * Prueba ubicar todas las rutas con table->seed. Los buckets van de mas
+ * grande a mas chico, y para cada uno se busca el primer desplazamiento con
+ * el que todas sus rutas caen en slots libres. Devuelve false si algun
+ * bucket no entra con ninguno.
+ */
+static bool static_routes_place(Static_Routes *table, Route **routes, u32 routes_count, u64 *hashes,
+                                u32 *buckets_order, u32 *buckets_start) {
+    u32 buckets_count = table->buckets_mask + 1;
+
+    memset(table->slots, 0, sizeof(Static_Route) * (table->slots_mask + 1));
+    memset(table->displacements, 0, sizeof(u32) * buckets_count);
+    memset(buckets_start, 0, sizeof(u32) * (buckets_count + 1));
+
+    for (u32 i = 0; i < routes_count; i++) {
+        hashes[i] = static_routes_hash(routes[i]->method, route_static_path(routes[i]), table->seed);
+        buckets_start[((hashes[i] >> 32) & table->buckets_mask) + 1]++;
+    }
+
+    // las rutas de cada bucket quedan juntas en buckets_order
+    u32 max_bucket_size = 0;
+    for (u32 b = 0; b < buckets_count; b++) {
+        if (buckets_start[b + 1] > max_bucket_size) {
+            max_bucket_size = buckets_start[b + 1];
+        }
+        buckets_start[b + 1] += buckets_start[b];
+    }
+
+    u32 *bucket_fill = table->displacements; // se usa de contador hasta guardar los desplazamientos
+    for (u32 i = 0; i < routes_count; i++) {
+        u32 bucket = (hashes[i] >> 32) & table->buckets_mask;
+        buckets_order[buckets_start[bucket] + bucket_fill[bucket]++] = i;
+    }
+    memset(table->displacements, 0, sizeof(u32) * buckets_count);
+
+    for (u32 size = max_bucket_size; size > 0; size--) {
+        for (u32 b = 0; b < buckets_count; b++) {
+
+            u32 *bucket_routes = buckets_order + buckets_start[b];
+            if (buckets_start[b + 1] - buckets_start[b] != size) {
+                continue;
+            }
+
+            u32 displacement = 0;
+            for (; displacement < STATIC_ROUTES_MAX_DISPLACEMENT; displacement++) {
+
+                bool fits = true;
+                for (u32 i = 0; i < size && fits; i++) {
+                    u32 slot = static_routes_slot(table, hashes[bucket_routes[i]], displacement);
+                    fits = table->slots[slot].route == NULL;
+
+                    // dos rutas del mismo bucket tampoco pueden compartir slot
+                    for (u32 j = 0; j < i && fits; j++) {
+                        fits = slot != static_routes_slot(table, hashes[bucket_routes[j]], displacement);
+                    }
+                }
+
+                if (fits) {
+                    break;
+                }
+            }
+
+            if (displacement == STATIC_ROUTES_MAX_DISPLACEMENT) {
+                return false;
+            }
+
+            table->displacements[b] = displacement;
+            for (u32 i = 0; i < size; i++) {
+                u32 slot = static_routes_slot(table, hashes[bucket_routes[i]], displacement);
+                table->slots[slot].route = routes[bucket_routes[i]];
+            }
+        }
+    }
+
+    return true;
+}
+
+static Route *static_routes_find(Static_Routes *table, Http_Method method, String path) {
+    // sin ninguna ruta de ese tamanio ni hace falta el hash
+    if ((table->path_sizes & (1ull << (path.size < 63 ? path.size : 63))) == 0) {
+        return NULL;
+    }
+
+    u64 hash = static_routes_hash(method, path, table->seed);
+    u32 displacement = table->displacements[(hash >> 32) & table->buckets_mask];
+    Static_Route *static_route = &table->slots[static_routes_slot(table, hash, displacement)];
+
+    if (static_route->route && static_route->method == method && static_route->path_size == path.size &&
+            memcmp(table->bytes + static_route->path_start, path.data, path.size) == 0) {
+        return static_route->route;
+    }
+
+    return NULL;
+}
+
+/*
+ * De a 8 bytes. El ultimo pedazo se lee solapado con el anterior en vez de
+ * byte por byte, asi todas las lecturas son de tamanio fijo y no hay
+ * llamadas a memcpy.
+ */
+static u64 static_routes_hash(Http_Method method, String path, u64 seed) {
+    const u8 *data = (const u8 *)path.data;
+    u64 hash = (seed + method) * 0x9E3779B97F4A7C15ull ^ path.size;
+
+    if (path.size >= 8) {
+        for (u32 i = 0; i + 8 < path.size; i += 8) {
+            hash = static_routes_mix(hash, load_u64(data + i));
+        }
+        hash = static_routes_mix(hash, load_u64(data + path.size - 8));
+    } else if (path.size >= 4) {
+        hash = static_routes_mix(hash, (u64)load_u32(data) << 32 | load_u32(data + path.size - 4));
+    } else if (path.size > 0) {
+        hash = static_routes_mix(hash, (u64)data[0] << 16 | (u64)data[path.size / 2] << 8 | data[path.size - 1]);
+    }
+
+    return hash ^ hash >> 32;
+}
+
+static inline u64 static_routes_mix(u64 hash, u64 word) {
+    hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+    return hash ^ hash >> 31;
+}
+
+// memcpy de tamanio fijo: el compilador lo deja en una lectura sin alinear
+static inline u64 load_u64(const u8 *data) {
+    u64 word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+static inline u32 load_u32(const u8 *data) {
+    u32 word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+// El desplazamiento se mezcla antes de multiplicar: dos rutas que caen en
+// el mismo slot con uno se separan con otro, cosa que un xor solo no haria.
+static inline u32 static_routes_slot(Static_Routes *table, u64 hash, u32 displacement) {
+    u64 mixed = (hash ^ displacement * 0x9E3779B97F4A7C15ull) * 0xFF51AFD7ED558CCDull;
+    return (u32)(mixed >> 32) & table->slots_mask;
+}
+
+// El path de una ruta sin params, tal cual esta en el pattern: desde la
+// '/' antes del primer segmento hasta el final del ultimo.
+static String route_static_path(Route *route) {
+    Segment_Pattern *last = route->first_segment;
+    while (last->next_segment) {
+        last = last->next_segment;
+    }
+
+    const char *start = route->first_segment->segment.data - 1;
+    return string_with_len(start, last->segment.data + last->segment.size - start);
+}
+
+/*
+ * Codifica la respuesta y la agrega a la cola de salida de la conexion.
+ * Se envia despues, cuando se termina de procesar lo que se leyo.
+ */
+static void connection_write(Connection *connection, Response response) {
+    Arena *arena = connection_output_arena(connection->context);
+    String encoded_response = connection_encode_response(arena, connection, response);
+
+    connection_push_output(connection->context, encoded_response);
+}
+
+/*
+ * Agrega Content-Length y Connection y codifica la respuesta en la arena
+ * indicada; a un HEAD se le contesta sin body. Tambien se usa desde los
+ * threads de offload, que no pueden tocar output_arenas porque el event
+ * loop las reinicia a medida que envia.
+ */
+static String connection_encode_response(Arena *arena, Connection *connection, Response response) {
+    String content_lenght_value = string_from_i64(arena, response.body.size);
+    String connection_value;
+
+    if (connection->keep_alive) {
+        connection_value = string_lit("keep-alive");
+    } else {
+        connection_value = string_lit("close");
+    }
+
+    headers_put(&response.headers, string_lit("Content-Length"), content_lenght_value);
+    headers_put(&response.headers, string_lit("Connection"), connection_value);
+
+    // el Content-Length es el que tendria el GET, pero el body no se manda:
+    // el cliente no lo espera y lo leeria como el comienzo de la proxima respuesta
+    if (connection->context->request.method == HTTP_METHOD_HEAD) {
+        response.body.size = 0;
+    }
+
+    return encode_response(arena, response);
+}
+
+/*
+ * Escribe en el socket todo lo que se pueda de la cola de salida. Si el
+ * socket se llena lo que falta queda encolado (incluso una respuesta a
+ * medio escribir) y se retoma cuando llegue EPOLLOUT.
+ * Devuelve -1 si fallo la escritura.
+ */
+static i32 connection_flush_output(Connection *connection) {
+    Connection_Context *context = connection->context;
+
+    while (context->first_output != NULL) {
+
+        struct iovec iov[OUTPUT_MAX_IOVECS];
+        u32 iov_count = 0;
+
+        for (Output_Chunk *chunk = context->first_output;
+             chunk != NULL && iov_count < OUTPUT_MAX_IOVECS;
+             chunk = chunk->next) {
+
+            iov[iov_count].iov_base = (void *)chunk->data.data;
+            iov[iov_count].iov_len = chunk->data.size;
+            iov_count++;
+        }
+
+        ssize_t bytes_sent = writev(connection->fd, iov, iov_count);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("[ERROR] connection_flush_output - error al escribir en la conexion\n");
+            return -1;
+        }
+
+        connection_consume_output(context, bytes_sent);
+    }
+
+    return 0;
+}
+
+static void connection_consume_output(Connection_Context *context, u64 size) {
+    context->output_size -= size;
+
+    while (size > 0) {
+        Output_Chunk *chunk = context->first_output;
+
+        if (size < chunk->data.size) {
+            chunk->data.data += size;
+            chunk->data.size -= size;
+            break;
+        }
+
+        size -= chunk->data.size;
+        context->first_output = chunk->next;
+
+        // ya se mando todo lo que habia en esa arena
+        context->output_chunks[chunk->arena]--;
+        if (context->output_chunks[chunk->arena] == 0) {
+            arena_reset(context->output_arenas[chunk->arena]);
+        }
+    }
+
+    if (context->first_output == NULL) {
+        context->last_output = NULL;
+    }
+}
+
+/*
+ * Arena donde codificar la proxima respuesta. Si la otra ya se vacio se
+ * pasa a esa, asi la actual deja de crecer y se puede reiniciar en cuanto
+ * se terminen de enviar sus chunks.
+ */
+static Arena *connection_output_arena(Connection_Context *context) {
+    u8 other = context->output_arena ^ 1;
+
+    if (context->output_chunks[context->output_arena] > 0 && context->output_chunks[other] == 0) {
+        context->output_arena = other;
+    }
+
+    return context->output_arenas[context->output_arena];
+}
+
+/*
+ * Encola data, que tiene que estar en la arena que devolvio
+ * connection_output_arena.
+ */
+static void connection_push_output(Connection_Context *context, String data) {
+    Output_Chunk *chunk = arena_alloc(context->output_arenas[context->output_arena], sizeof(Output_Chunk));
+    chunk->next = NULL;
+    chunk->data = data;
+    chunk->arena = context->output_arena;
+
+    context->output_chunks[chunk->arena]++;
+    context->output_size += data.size;
+
+    if (context->first_output == NULL) {
+        context->first_output = chunk;
+    } else {
+        context->last_output->next = chunk;
+    }
+    context->last_output = chunk;
+}
+
+static String encode_response(Arena *arena, Response response) {
+    String line_separator = string_lit("\r\n");
+    String colon_separator = string_lit(": ");
+    String space_separator = string_lit(" ");
+
+    String version = string_lit("HTTP/1.1 ");
+    String status = string_from_i64(arena, response.status);
+    String status_description = http_status_reason(response.status);
+    String body = string_with_len((char *)response.body.data, response.body.size);
+
+    // calculo de capacidad
+    u32 response_minimum_size = version.size +
+        status.size +
+        status_description.size +
+        body.size +
+        1 + 2 + 2; // space + first line \r\n + headers \r\n
+
+    for (u32 i = 0; i < MAX_HEADERS_CAPACITY; i++) {
+        Header header = response.headers.headers[i];
+        if (header.occupied) {
+            // + 4 por colon + salto de linea (2 c/u)
+            response_minimum_size += header.field_name.size + header.field_value.size + 4;
+        }
+    }
+
+    String_Builder builder = {0};
+    sbuilder_init_cap(&builder, arena, response_minimum_size);
+    sbuilder_append(&builder, version);
+    sbuilder_append(&builder, status);
+    sbuilder_append(&builder, space_separator);
+    sbuilder_append(&builder, status_description);
+    sbuilder_append(&builder, line_separator);
+
+    for (u32 i = 0; i < MAX_HEADERS_CAPACITY; i++) {
+        Header header = response.headers.headers[i];
+        if (header.occupied) {
+            sbuilder_append(&builder, header.field_name);
+            sbuilder_append(&builder, colon_separator);
+            sbuilder_append(&builder, header.field_value);
+            sbuilder_append(&builder, line_separator);
+        }
+    }
+
+    sbuilder_append(&builder, line_separator);
+
+    if (response.body.size > 0) {
+        sbuilder_append(&builder, body);
+    }
+
+    return sbuilder_to_string(&builder);
+}
+
+static i32 events_add_fd(i32 events_fd, i32 fd, void *data, u32 flags) {
 #if OS_MAC
+    u16 kevent_flags = EV_ADD;
+    if (flags & EVENTS_FLAG_EDGE_TRIGGERED) {
+        kevent_flags |= EV_CLEAR;
+    }
+
     struct kevent changelist[1];
-    EV_SET(changelist, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+    EV_SET(changelist, fd, EVFILT_READ, kevent_flags, 0, 0, data);
     return kevent(events_fd, changelist, 1, NULL, 0, NULL);
 #else
     struct epoll_event event;
     event.events = EPOLLIN;
-    event.data.fd = fd;
+    if (flags & EVENTS_FLAG_EDGE_TRIGGERED) {
+        event.events |= EPOLLET;
+    }
+    if (flags & EVENTS_FLAG_EXCLUSIVE) {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    event.data.ptr = data;
     return epoll_ctl(events_fd, EPOLL_CTL_ADD, fd, &event);
 #endif
 }
 
-static i32 events_remove_fd(i32 events_fd, i32 fd) {
-    i32 res;
-#if OS_MAC
-    struct kevent kev;
-    EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
-    res = kevent(events_fd, &kev, 1, NULL, 0, NULL);
-#else
-    res = epoll_ctl(events_fd, EPOLL_CTL_DEL, fd, NULL);
+static i32 events_modify_fd(i32 events_fd, i32 fd, void *data, u32 flags, u32 old_interest, u32 interest) {
+#if OS_MAC
+    u16 kevent_flags = 0;
+    if (flags & EVENTS_FLAG_EDGE_TRIGGERED) {
+        kevent_flags |= EV_CLEAR;
+    }
+
+    struct kevent changelist[2];
+    u32 changes = 0;
+
+    if ((old_interest ^ interest) & EVENTS_INTEREST_READ) {
+        u16 action = (interest & EVENTS_INTEREST_READ) ? EV_ENABLE : EV_DISABLE;
+        EV_SET(&changelist[changes++], fd, EVFILT_READ, action | kevent_flags, 0, 0, data);
+    }
+
+    if ((old_interest ^ interest) & EVENTS_INTEREST_WRITE) {
+        u16 action = (interest & EVENTS_INTEREST_WRITE) ? EV_ADD | EV_ENABLE : EV_DISABLE;
+        EV_SET(&changelist[changes++], fd, EVFILT_WRITE, action | kevent_flags, 0, 0, data);
+    }
+
+    return kevent(events_fd, changelist, changes, NULL, 0, NULL);
+#else
+    (void)old_interest; // epoll reemplaza todo el interes de una vez
+
+    struct epoll_event event;
+    event.events = 0;
+    if (interest & EVENTS_INTEREST_READ) {
+        event.events |= EPOLLIN;
+    }
+    if (interest & EVENTS_INTEREST_WRITE) {
+        event.events |= EPOLLOUT;
+    }
+    if (flags & EVENTS_FLAG_EDGE_TRIGGERED) {
+        event.events |= EPOLLET;
+    }
+    event.data.ptr = data;
+    return epoll_ctl(events_fd, EPOLL_CTL_MOD, fd, &event);
+#endif
+}
+
+static i32 events_remove_fd(i32 events_fd, i32 fd) {
+    i32 res;
+#if OS_MAC
+    struct kevent kev;
+    EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+    res = kevent(events_fd, &kev, 1, NULL, 0, NULL);
+#else
+    res = epoll_ctl(events_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    if (res == -1) {
+        return -1;
+    } else {
+        return close(fd);
+    }
+}
+
+#if OS_LINUX
+
+/*
+ * Cada operacion se identifica en el user_data con el puntero a quien le pertenece y
+ * el tipo de operacion en los 3 bits bajos (los punteros estan alineados).
+ */
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV   = 2,
+    URING_OP_SEND   = 3,
+    URING_OP_WAKEUP = 4,
+    URING_OP_TICK   = 5,
+};
+
+#define URING_OP_MASK 7
+
+/*
+ * Arma el ring del worker. Devuelve -1 si el kernel no tiene todo lo que se
+ * usa (el worker vuelve a epoll): el ring de buffers y el accept multishot
+ * son de linux 5.19, pero el recv multishot recien de 6.0.
+ */
+static i32 uring_init(Worker *worker) {
+    Uring *uring = &worker->uring;
+    *uring = (Uring){0};
+
+    u8 *rings = MAP_FAILED;
+    u64 rings_size = 0;
+    u64 sqes_size = 0;
+    u64 buffers_ring_size = URING_BUFFERS_COUNT * sizeof(struct io_uring_buf);
+    u64 buffers_size = URING_BUFFERS_COUNT * MAX_PARSER_BUFFER_CAPACITY;
+
+    uring->sqes = MAP_FAILED;
+    uring->buffers_ring = MAP_FAILED;
+    uring->buffers = MAP_FAILED;
+
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+    uring->fd = (i32)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring->fd == -1 && errno == EINVAL) {
+        // kernel viejo que no conoce los flags, se reintenta sin ellos
+        params = (struct io_uring_params){0};
+        uring->fd = (i32)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+
+    if (uring->fd == -1) {
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        goto failed;
+    }
+
+    u64 sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    u64 cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    rings_size = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+
+    rings = mmap(0, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 uring->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        goto failed;
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        goto failed;
+    }
+
+    uring->sq_head = (u32 *)(rings + params.sq_off.head);
+    uring->sq_tail = (u32 *)(rings + params.sq_off.tail);
+    uring->sq_mask = *(u32 *)(rings + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->sq_local_tail = *uring->sq_tail;
+
+    // los sqes se consumen siempre en orden, asi que el array es la identidad
+    u32 *sq_array = (u32 *)(rings + params.sq_off.array);
+    for (u32 i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    uring->cq_head = (u32 *)(rings + params.cq_off.head);
+    uring->cq_tail = (u32 *)(rings + params.cq_off.tail);
+    uring->cq_mask = *(u32 *)(rings + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    // ring de buffers provistos para los recv multishot
+    uring->buffers_ring = mmap(0, buffers_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring->buffers = mmap(0, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buffers_ring == MAP_FAILED || uring->buffers == MAP_FAILED) {
+        goto failed;
+    }
+
+    struct io_uring_buf_reg buffers_reg = {0};
+    buffers_reg.ring_addr = (u64)(uintptr_t)uring->buffers_ring;
+    buffers_reg.ring_entries = URING_BUFFERS_COUNT;
+    buffers_reg.bgid = 0;
+
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &buffers_reg, 1) == -1) {
+        goto failed;
+    }
+
+    for (u16 i = 0; i < URING_BUFFERS_COUNT; i++) {
+        uring_recycle_buffer(uring, i);
+    }
+
+    if (!uring_probe_recv_multishot(uring)) {
+        goto failed;
+    }
+
+    uring_queue_accept(worker);
+    uring_queue_wakeup(worker);
+    uring_queue_tick(worker);
+
+    return 0;
+
+failed:
+    if (uring->buffers != MAP_FAILED) {
+        munmap(uring->buffers, buffers_size);
+    }
+    if (uring->buffers_ring != MAP_FAILED) {
+        munmap(uring->buffers_ring, buffers_ring_size);
+    }
+    if (uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, sqes_size);
+    }
+    if (rings != MAP_FAILED) {
+        munmap(rings, rings_size);
+    }
+    close(uring->fd);
+
+    *uring = (Uring){0};
+    return -1;
+}
+
+/*
+ * Manda un recv multishot sobre un socketpair cuyo otro lado ya cerro y
+ * espera su completion: un kernel que lo soporta contesta 0 (fin del
+ * stream) y termina el multishot, uno anterior a 6.0 contesta -EINVAL.
+ */
+static bool uring_probe_recv_multishot(Uring *uring) {
+    i32 fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        return false;
+    }
+    shutdown(fds[1], SHUT_WR);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = 0;
+
+    bool supported = false;
+
+    for (;;) {
+        u32 head = *uring->cq_head;
+        if (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+
+            supported = cqe->res >= 0;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                uring_recycle_buffer(uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+
+            __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        if (uring_submit(uring, 1) == -1 && errno != EINTR) {
+            break;
+        }
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return supported;
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *uring) {
+    u32 head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (uring->sq_local_tail - head >= uring->sq_entries) {
+        // ring lleno, se envia lo que hay
+        uring_submit(uring, 0);
+    }
+
+    struct io_uring_sqe *sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_local_tail++;
+
+    return sqe;
+}
+
+/*
+ * Publica los sqes pendientes y opcionalmente espera a que haya al menos
+ * `wait` completions. Es la unica syscall del event loop.
+ */
+static i32 uring_submit(Uring *uring, u32 wait) {
+    u32 to_submit = uring->sq_local_tail - *uring->sq_tail;
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+
+    u32 flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (to_submit == 0 && wait == 0) {
+        return 0;
+    }
+
+    return (i32)syscall(__NR_io_uring_enter, uring->fd, to_submit, wait, flags, NULL, 0);
+}
+
+static void uring_recycle_buffer(Uring *uring, u16 buffer_id) {
+    struct io_uring_buf *buffer = &uring->buffers_ring->bufs[uring->buffers_tail & (URING_BUFFERS_COUNT - 1)];
+    buffer->addr = (u64)(uintptr_t)(uring->buffers + (u64)buffer_id * MAX_PARSER_BUFFER_CAPACITY);
+    buffer->len = MAX_PARSER_BUFFER_CAPACITY;
+    buffer->bid = buffer_id;
+
+    uring->buffers_tail++;
+    __atomic_store_n(&uring->buffers_ring->tail, uring->buffers_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_queue_accept(Worker *worker) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker->uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = (u64)(uintptr_t)worker | URING_OP_ACCEPT;
+}
+
+static void uring_queue_wakeup(Worker *worker) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker->uring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = worker->wakeup_fds[0];
+    sqe->addr = (u64)(uintptr_t)&worker->uring.wakeup_value;
+    sqe->len = sizeof(worker->uring.wakeup_value);
+    sqe->user_data = (u64)(uintptr_t)worker | URING_OP_WAKEUP;
+}
+
+/*
+ * Timeout de un tick del timer wheel, equivalente al timeout del epoll_wait.
+ */
+static void uring_queue_tick(Worker *worker) {
+    Uring *uring = &worker->uring;
+    uring->tick_timeout.tv_sec = 0;
+    uring->tick_timeout.tv_nsec = TIMER_WHEEL_TICK_MS * 1000000L;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (u64)(uintptr_t)&uring->tick_timeout;
+    sqe->len = 1;
+    sqe->user_data = (u64)(uintptr_t)worker | URING_OP_TICK;
+}
+
+static void uring_queue_recv(Worker *worker, Connection *connection) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker->uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (u64)(uintptr_t)connection | URING_OP_RECV;
+
+    connection->recv_armed = true;
+}
+
+/*
+ * Backpressure: si el cliente no lee sus respuestas se cancela el recv
+ * multishot, asi no se siguen procesando requests que solo agrandarian la
+ * cola de salida. Se rearma cuando los sends bajan del high water mark.
+ */
+static void uring_pause_recv(Worker *worker, Connection *connection) {
+    if (!(connection->events_interest & EVENTS_INTEREST_READ)) {
+        return;
+    }
+
+    connection->events_interest &= ~EVENTS_INTEREST_READ;
+
+    if (connection->recv_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&worker->uring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (u64)(uintptr_t)connection | URING_OP_RECV;
+        sqe->user_data = 0; // el resultado de la cancelacion no interesa
+    }
+}
+
+static void uring_resume_recv(Worker *worker, Connection *connection) {
+    if ((connection->events_interest & EVENTS_INTEREST_READ) || connection->waiting_offload) {
+        return;
+    }
+
+    connection->events_interest |= EVENTS_INTEREST_READ;
+
+    // si el cancel todavia no se completo el recv sigue armado
+    if (!connection->recv_armed) {
+        uring_queue_recv(worker, connection);
+    }
+}
+
+/*
+ * Envia las respuestas encoladas con un unico sendmsg, el equivalente al
+ * writev de epoll. Los chunks siguen en la cola hasta que el kernel avisa
+ * cuanto se mando; mientras haya un sendmsg en vuelo no se arma otro.
+ */
+static void uring_flush_output(Worker *worker, Connection *connection) {
+    Connection_Context *context = connection->context;
+    if (context == NULL || context->sends_in_flight > 0 || context->first_output == NULL) {
+        return;
+    }
+
+    // tiene que vivir hasta que se complete el send
+    Arena *arena = context->output_arenas[context->output_arena];
+    struct msghdr *message = arena_alloc(arena, sizeof(struct msghdr) + sizeof(struct iovec) * OUTPUT_MAX_IOVECS);
+    struct iovec *iov = (struct iovec *)(message + 1);
+    u32 iov_count = 0;
+
+    for (Output_Chunk *chunk = context->first_output;
+         chunk != NULL && iov_count < OUTPUT_MAX_IOVECS;
+         chunk = chunk->next) {
+
+        iov[iov_count].iov_base = (void *)chunk->data.data;
+        iov[iov_count].iov_len = chunk->data.size;
+        iov_count++;
+    }
+
+    message->msg_iov = iov;
+    message->msg_iovlen = iov_count;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker->uring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection->fd;
+    sqe->addr = (u64)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = (u64)(uintptr_t)connection | URING_OP_SEND;
+
+    context->sends_in_flight++;
+}
+
+/*
+ * Una conexion recien se puede liberar cuando el kernel no tiene mas
+ * operaciones suyas en vuelo. El shutdown hace que el recv multishot termine.
+ */
+static void uring_close_connection(Worker *worker, Connection *connection) {
+    // el handler sigue en el pool, worker_finish_offload la vuelve a cerrar
+    if (connection->waiting_offload) {
+        if (connection->state == CONNECTION_STATE_ACTIVE) {
+            connection->state = CONNECTION_STATE_FAILED;
+        }
+        return;
+    }
+
+    if (connection->state == CONNECTION_STATE_ACTIVE) {
+        connection->state = CONNECTION_STATE_CLOSING;
+        uring_flush_output(worker, connection);
+    }
+
+    if (connection->context && connection->context->sends_in_flight > 0) {
+        return;
+    }
+
+    if (connection->recv_armed) {
+        shutdown(connection->fd, SHUT_RDWR);
+        return;
+    }
+
+    close(connection->fd);
+    worker_detach_context(worker, connection);
+    worker_release_connection(worker, connection);
+}
+
+static void uring_handle_accept(Worker *worker, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_queue_accept(worker);
+    }
+
+    if (cqe->res < 0) {
+        printf("error al aceptar cliente\n");
+        return;
+    }
+
+    i32 client_fd = cqe->res;
+
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    getpeername(client_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+
+    Connection *connection = worker_alloc_connection(worker);
+    connection_init(connection, client_fd, client_addr);
+    connection->recv_armed = false;
+
+    uring_queue_recv(worker, connection);
+    worker_update_timeout(worker, connection);
+}
+
+static void uring_handle_recv(Worker *worker, Connection *connection, struct io_uring_cqe *cqe) {
+    Uring *uring = &worker->uring;
+
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        connection->recv_armed = false;
+    }
+
+    bool reading_paused = !(connection->events_interest & EVENTS_INTEREST_READ);
+
+    if (cqe->res == -ENOBUFS && connection->state == CONNECTION_STATE_ACTIVE) {
+        // se quedo sin buffers provistos; ya se devolvieron, se rearma
+        if (!reading_paused) {
+            uring_queue_recv(worker, connection);
+        }
+        return;
+    }
+
+    if (cqe->res == -ECANCELED && connection->state == CONNECTION_STATE_ACTIVE) {
+        // lo cancelo uring_pause_recv; si ya se retomo la lectura se rearma
+        if (!reading_paused) {
+            uring_queue_recv(worker, connection);
+        }
+        return;
+    }
+
+    if (cqe->res <= 0 || connection->state != CONNECTION_STATE_ACTIVE) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_recycle_buffer(uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        uring_close_connection(worker, connection);
+        return;
+    }
+
+    u16 buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    u8 *data = uring->buffers + (u64)buffer_id * MAX_PARSER_BUFFER_CAPACITY;
+    u32 remaining = cqe->res;
+
+    if (connection->context == NULL) {
+        worker_attach_context(worker, connection);
+    }
+
+    Connection_Context *context = connection->context;
+    Parser *parser = &context->parser;
+
+    // Se copia todo aunque la conexion este frenada: queda en los buffers
+    // hasta que se retome. Pero el recv multishot sigue leyendo hasta que
+    // se completa el cancel, asi que a diferencia de epoll no hay
+    // backpressure de TCP; un cliente que manda mas de MAX_PARSER_BUFFERS
+    // sin leer las respuestas se corta.
+    while (remaining > 0) {
+        Parser_Buffer *buffer = parser_read_buffer(parser);
+        if (buffer == NULL) {
+            printf("[ERROR] uring_handle_recv - demasiados requests sin atender en la conexion\n");
+            uring_recycle_buffer(uring, buffer_id);
+            uring_close_connection(worker, connection);
+            return;
+        }
+
+        u32 space = buffer->size - buffer->used;
+        u32 size = remaining < space ? remaining : space;
+        memcpy(buffer->data + buffer->used, data, size);
+        buffer->used += size;
+
+        data += size;
+        remaining -= size;
+    }
+
+    uring_recycle_buffer(uring, buffer_id);
+
+    bool remove_connection = connection_process_input(worker, connection);
+
+    if (remove_connection) {
+        uring_close_connection(worker, connection);
+        return;
+    }
+
+    uring_flush_output(worker, connection);
+
+    if (context->output_size > worker->server->output_high_water_mark || connection->waiting_offload) {
+        uring_pause_recv(worker, connection);
+    } else if (!more && !reading_paused) {
+        uring_queue_recv(worker, connection);
+    }
+
+    if (connection_context_idle(context)) {
+        worker_detach_context(worker, connection);
+    }
+
+    worker_update_timeout(worker, connection);
+}
+
+static void uring_handle_send(Worker *worker, Connection *connection, struct io_uring_cqe *cqe) {
+    Connection_Context *context = connection->context;
+    context->sends_in_flight--;
+
+    if (cqe->res > 0) {
+        connection_consume_output(context, cqe->res);
+
+        // el cliente esta leyendo las respuestas, no esta ocioso
+        if (connection->timeout_kind == TIMEOUT_KIND_IDLE) {
+            connection->timeout_kind = TIMEOUT_KIND_NONE;
+        }
+    } else if (cqe->res < 0) {
+        // tambien si estaba cerrandose: volver a mandar la cola fallaria igual
+        connection->state = CONNECTION_STATE_FAILED;
+    }
+
+    if (context->sends_in_flight > 0) {
+        return;
+    }
+
+    // antes de cerrar se manda lo que no entro en el primer sendmsg
+    if (connection->state == CONNECTION_STATE_CLOSING && context->first_output != NULL) {
+        uring_flush_output(worker, connection);
+        return;
+    }
+
+    if (connection->state != CONNECTION_STATE_ACTIVE) {
+        uring_close_connection(worker, connection);
+        return;
+    }
+
+    // requests pipelined que quedaron frenados por el high water mark
+    if (connection_process_input(worker, connection)) {
+        uring_close_connection(worker, connection);
+        return;
+    }
+
+    uring_flush_output(worker, connection);
+
+    if (context->output_size <= worker->server->output_high_water_mark) {
+        uring_resume_recv(worker, connection);
+    }
+
+    if (connection_context_idle(context)) {
+        worker_detach_context(worker, connection);
+    }
+
+    worker_update_timeout(worker, connection);
+}
+
+static void uring_run(Worker *worker) {
+    Uring *uring = &worker->uring;
+
+    while (main_running) {
+
+        if (uring_submit(uring, 1) == -1 && errno != EINTR && errno != EBUSY) {
+            printf("error en io_uring_enter\n");
+            break;
+        }
+
+        u32 head = *uring->cq_head;
+        u32 tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+
+            u32 op = cqe->user_data & URING_OP_MASK;
+            void *owner = (void *)(uintptr_t)(cqe->user_data & ~(u64)URING_OP_MASK);
+
+            switch (op) {
+                case URING_OP_ACCEPT:
+                    uring_handle_accept(worker, cqe);
+                    break;
+                case URING_OP_RECV:
+                    uring_handle_recv(worker, (Connection *)owner, cqe);
+                    break;
+                case URING_OP_SEND:
+                    uring_handle_send(worker, (Connection *)owner, cqe);
+                    break;
+                case URING_OP_WAKEUP:
+                    uring_queue_wakeup(worker);
+                    worker_drain_offload(worker);
+                    break;
+                case URING_OP_TICK:
+                    worker_expire_timers(worker);
+                    uring_queue_tick(worker);
+                    break;
+                default: break;
+            }
+
+            head++;
+        }
+
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    close(uring->fd);
+}
+
+#endif
+
+static void parser_init(Parser *parser, Arena *arena, Buffer_Pool *pool) {
+    *parser = (Parser){0};
+    parser->arena = arena;
+    parser->pool = pool;
+    parser->first_buffer = NULL;
+    parser->last_buffer = NULL;
+    parser->current_buffer = NULL;
+    parser->at = 0;
+    parser->marked_buffer = NULL;
+    parser->marked_at = 0;
+    parser->state = PARSER_STATE_STARTED;
+}
+
+static char parser_get_char(Parser *parser) {
+    return parser->current_buffer->data[parser->at];
+}
+
+static String parser_extract_until(Parser *parser, Parser_Buffer *last_buffer, u32 last_buffer_offset);
+
+static void parser_mark(Parser *parser, u32 at) {
+    parser->marked_buffer = parser->current_buffer;
+    parser->marked_at = at;
+}
+
+/*
+ * Devuelve el token desde la marca hasta last_buffer_offset (inclusive) del
+ * buffer actual. Casi siempre el token entero esta en un solo buffer y se
+ * devuelve una vista sobre el, sin copiar nada: vive lo mismo que el request.
+ * Solo si quedo partido entre varios reads se junta en la arena.
+ */
+static String parser_extract_block(Parser *parser, u32 last_buffer_offset) {
+    return parser_extract_until(parser, parser->current_buffer, last_buffer_offset);
+}
+
+/*
+ * Como parser_extract_block pero hasta un buffer que no es el actual. Lo
+ * usa el body chunked, que termina antes que lo que se leyo.
+ */
+static String parser_extract_until(Parser *parser, Parser_Buffer *last_buffer, u32 last_buffer_offset) {
+
+    Parser_Buffer *first_buffer = parser->marked_buffer;
+
+    u8 *first_buffer_offset = first_buffer->data + parser->marked_at;
+
+    if (first_buffer == last_buffer) {
+        String result = {
+            .data = (char *)first_buffer_offset,
+            .size = last_buffer_offset - parser->marked_at + 1
+        };
+
+        return result;
+    }
+
+    // Los buffers anteriores al actual pueden no estar llenos: cada uno
+    // tiene lo que devolvio su read.
+    u32 first_buffer_remaining_size = first_buffer->used - parser->marked_at;
+    u32 total_size = first_buffer_remaining_size + last_buffer_offset + 1;
+
+    for (Parser_Buffer *buffer = first_buffer->next; buffer != last_buffer; buffer = buffer->next) {
+        total_size += buffer->used;
+    }
+
+    u8 *data = arena_alloc_aligned(parser->arena, total_size, 1);
+    u8 *next_memcpy = data;
+
+    memcpy(next_memcpy, first_buffer_offset, first_buffer_remaining_size);
+    next_memcpy += first_buffer_remaining_size;
+
+    for (Parser_Buffer *buffer = first_buffer->next; buffer != last_buffer; buffer = buffer->next) {
+        memcpy(next_memcpy, buffer->data, buffer->used);
+        next_memcpy += buffer->used;
+    }
+
+    memcpy(next_memcpy, last_buffer->data, last_buffer_offset + 1);
+
+    String result = {
+        .data = (char *)data,
+        .size = total_size
+    };
+
+    return result;
+}
+
+/*
+ * Pasa a minusculas sin copiar. El token siempre es memoria del parser (una
+ * vista sobre el buffer o una copia en la arena), asi que se puede pisar.
+ */
+static String parser_lower_in_place(String str) {
+    char *data = (char *)str.data;
+
+    for (u32 i = 0; i < str.size; i++) {
+        if (data[i] >= 'A' && data[i] <= 'Z') {
+            data[i] += 'a' - 'A';
+        }
+    }
+
+    return str;
+}
+
+/*
+ * Busca el proximo '\r' en [from, to) del buffer y devuelve su posicion, o
+ * to si no esta. Los values de los headers (cookies, user-agent) son la
+ * mayor parte de un request, asi que se comparan de a 16 bytes con SSE2,
+ * que todo x86-64 tiene. Solo se leen bytes que trajo el read, por eso los
+ * ultimos (menos de 16) se recorren de a uno. De a 32 con AVX2 solo gana
+ * en values de mas de ~200 bytes y en un request entero resulto mas lento.
+ */
+static u32 parser_find_cr(Parser_Buffer *buffer, u32 from, u32 to) {
+    u8 *data = buffer->data;
+    u32 i = from;
+
+#if defined(__x86_64__)
+    __m128i cr = _mm_set1_epi8('\r');
+
+    while (i + 16 <= to) {
+        __m128i chunk = _mm_loadu_si128((__m128i *)(data + i));
+        u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#endif
+
+    for (; i < to; i++) {
+        if (data[i] == '\r') {
+            return i;
+        }
+    }
+
+    return to;
+}
+
+/*
+ * Tabla de clases de caracteres del parser: con una sola lectura se sabe
+ * si un byte puede ir en cada parte del request. Se arma en tiempo de
+ * compilacion expandiendo CHAR_CLASS_OF para los 256 valores.
+ */
+#define CHAR_IS_LETTER(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define CHAR_IS_ALPHANUM(c) (CHAR_IS_LETTER(c) || ((c) >= '0' && (c) <= '9'))
+
+// RFC 3986: unreserved (- . _ ~), sub-delims (! $ & ' ( ) * + , ; =), los
+// separadores que pueden ir en path y query (: @ / ?) y el % de los escapes
+#define CHAR_IS_URI_SYMBOL(c) ( \
+    (c) == '-' || (c) == '.' || (c) == '_' || (c) == '~' || \
+    (c) == '!' || (c) == '$' || (c) == '&' || (c) == '\'' || (c) == '(' || (c) == ')' || \
+    (c) == '*' || (c) == '+' || (c) == ',' || (c) == ';' || (c) == '=' || \
+    (c) == ':' || (c) == '@' || (c) == '/' || (c) == '?' || (c) == '%')
+
+#define CHAR_CLASS_OF(c) ( \
+    (CHAR_IS_LETTER(c) ? CHAR_CLASS_METHOD : 0) | \
+    ((CHAR_IS_ALPHANUM(c) || CHAR_IS_URI_SYMBOL(c)) ? CHAR_CLASS_URI : 0) | \
+    (((c) == 'H' || (c) == 'T' || (c) == 'P' || (c) == '/' || \
+      (c) == '1' || (c) == '0' || (c) == '.') ? CHAR_CLASS_VERSION : 0) | \
+    (CHAR_IS_ALPHANUM(c) ? CHAR_CLASS_HEADER_NAME_START : 0) | \
+    ((CHAR_IS_ALPHANUM(c) || (c) == '-' || (c) == '_') ? CHAR_CLASS_HEADER_NAME : 0))
+
+#define CHAR_CLASS_4(c)  CHAR_CLASS_OF(c), CHAR_CLASS_OF((c) + 1), CHAR_CLASS_OF((c) + 2), CHAR_CLASS_OF((c) + 3)
+#define CHAR_CLASS_16(c) CHAR_CLASS_4(c), CHAR_CLASS_4((c) + 4), CHAR_CLASS_4((c) + 8), CHAR_CLASS_4((c) + 12)
+#define CHAR_CLASS_64(c) CHAR_CLASS_16(c), CHAR_CLASS_16((c) + 16), CHAR_CLASS_16((c) + 32), CHAR_CLASS_16((c) + 48)
+
+static const u8 char_classes[256] = {
+    CHAR_CLASS_64(0), CHAR_CLASS_64(64), CHAR_CLASS_64(128), CHAR_CLASS_64(192)
+};
+
+static inline bool char_is(u8 c, Char_Class char_class) {
+    return char_classes[c] & char_class;
+}
+
+/*
+ * Devuelve la posicion del primer byte de [from, to) que no es de la
+ * clase, o to.
+ */
+static u32 parser_skip_class(Parser_Buffer *buffer, u32 from, u32 to, Char_Class char_class) {
+    u8 *data = buffer->data;
+
+    for (u32 i = from; i < to; i++) {
+        if (!char_is(data[i], char_class)) {
+            return i;
+        }
+    }
+
+    return to;
+}
+
+#if defined(__x86_64__)
+/*
+ * pcmpestri con rangos: devuelve la posicion de cada bloque de 16 bytes
+ * del primer byte que no esta en ninguno de los rangos. Los caracteres del
+ * URI de la RFC 3986 entran en 7 rangos: "$;" cubre $ % & ' ( ) * + , - . /
+ * los digitos : y ;, "?Z" cubre ? @ y las mayusculas.
+ */
+__attribute__((target("sse4.2")))
+static u32 parser_skip_uri_chars_sse42(u8 *data, u32 i, u32 to) {
+    const __m128i ranges = _mm_setr_epi8('!', '!', '$', ';', '=', '=', '?', 'Z',
+                                         '_', '_', 'a', 'z', '~', '~', 0, 0);
+
+    while (i + 16 <= to) {
+        __m128i chunk = _mm_loadu_si128((__m128i *)(data + i));
+        i32 index = _mm_cmpestri(ranges, 14, chunk, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY);
+        if (index < 16) {
+            return i + index;
+        }
+        i += 16;
+    }
+
+    return i;
+}
+#endif
+
+/*
+ * Devuelve la posicion del primer caracter que no puede ir en el URI (el
+ * espacio que lo termina o uno invalido) en [from, to), o to.
+ */
+static u32 parser_skip_uri_chars(Parser_Buffer *buffer, u32 from, u32 to) {
+    u8 *data = buffer->data;
+    u32 i = from;
+
+#if defined(__x86_64__)
+    // el runtime del compilador lo resuelve una vez al cargar el programa,
+    // antes de que arranquen los workers: aca es solo leer una variable
+    if (__builtin_cpu_supports("sse4.2")) {
+        i = parser_skip_uri_chars_sse42(data, i, to);
+    }
 #endif
-    if (res == -1) {
-        return -1;
+
+    return parser_skip_class(buffer, i, to, CHAR_CLASS_URI);
+}
+
+/*
+ * Devuelve el buffer donde va el proximo read, en data + used con
+ * size - used bytes de lugar. Se sigue llenando el ultimo buffer mientras
+ * le quede lugar y recien despues se pide otro al pool. Devuelve NULL si
+ * la conexion ya tiene MAX_PARSER_BUFFERS: un request demasiado grande o
+ * demasiados pipelined sin atender.
+ */
+static Parser_Buffer *parser_read_buffer(Parser *parser) {
+    Parser_Buffer *last_buffer = parser->last_buffer;
+
+    if (last_buffer) {
+        // Un body en streaming ya se entrego entero hasta aca: el buffer se
+        // pisa con el proximo read en vez de agregar otro.
+        if (parser->body_streaming && last_buffer == parser->stream_buffer &&
+            last_buffer == parser->current_buffer && parser->at == last_buffer->used) {
+
+            last_buffer->used = 0;
+            parser->at = 0;
+            return last_buffer;
+        }
+
+        if (last_buffer->size - last_buffer->used >= MIN_READ_SPACE) {
+            return last_buffer;
+        }
+
+        if (parser->buffers_count == MAX_PARSER_BUFFERS) {
+            return NULL;
+        }
+    }
+
+    Parser_Buffer *new_buffer = buffer_pool_get(parser->pool);
+    new_buffer->next = NULL;
+    new_buffer->used = 0;
+
+    if (last_buffer == NULL) {
+        parser->first_buffer = new_buffer;
+        parser->current_buffer = new_buffer;
+        parser->at = 0;
     } else {
-        return close(fd);
+        last_buffer->next = new_buffer;
+    }
+    parser->last_buffer = new_buffer;
+    parser->buffers_count++;
+
+    if (parser->body_streaming && parser->stream_buffer == NULL) {
+        parser->stream_buffer = new_buffer;
     }
+
+    return new_buffer;
 }
 
-static void parser_init(Parser *parser, Arena * arena) {
-    *parser = (Parser){0};
-    parser->arena = arena;
-    parser->bytes_read = 0;
+/*
+ * Devuelve todos los buffers al pool, por ejemplo al soltar el contexto.
+ */
+static void parser_release_buffers(Parser *parser) {
+    Parser_Buffer *buffer = parser->first_buffer;
+    while (buffer != NULL) {
+        Parser_Buffer *next = buffer->next;
+        buffer_pool_put(parser->pool, buffer);
+        buffer = next;
+    }
+
     parser->first_buffer = NULL;
     parser->last_buffer = NULL;
     parser->current_buffer = NULL;
     parser->at = 0;
+    parser->buffers_count = 0;
+}
+
+/*
+ * Entre requests, despues de parser_next_request: ya no hay vistas sobre
+ * los buffers, asi que se devuelven al pool los que se parsearon enteros.
+ * Si lo que queda del proximo request es poco y el buffer se esta por
+ * llenar, se mueve al principio para que el proximo read lo complete ahi.
+ */
+static void parser_recycle_buffers(Parser *parser) {
+    if (!parser_has_input(parser)) {
+        parser_release_buffers(parser);
+        return;
+    }
+
+    if (parser->at == parser->current_buffer->used) {
+        parser->current_buffer = parser->current_buffer->next;
+        parser->at = 0;
+    }
+
+    while (parser->first_buffer != parser->current_buffer) {
+        Parser_Buffer *buffer = parser->first_buffer;
+        parser->first_buffer = buffer->next;
+        buffer_pool_put(parser->pool, buffer);
+        parser->buffers_count--;
+    }
+
+    Parser_Buffer *buffer = parser->current_buffer;
+    u32 pending = buffer->used - parser->at;
+
+    if (buffer == parser->last_buffer && parser->at > 0 && pending <= MAX_COMPACT_SIZE &&
+        buffer->size - buffer->used < MIN_READ_SPACE) {
+
+        memmove(buffer->data, buffer->data + parser->at, pending);
+        buffer->used = pending;
+        parser->at = 0;
+    }
+}
+
+static bool parser_has_input(Parser *parser) {
+    Parser_Buffer *buffer = parser->current_buffer;
+    if (buffer == NULL) {
+        return false;
+    }
+
+    return parser->at < buffer->used || (buffer->next != NULL && buffer->next->used > 0);
+}
+
+/*
+ * Empieza el proximo request en donde termino el anterior, sin soltar los
+ * buffers: ahi estan los bytes que el cliente ya mando (pipelining). Los
+ * que ya no hacen falta los devuelve parser_recycle_buffers.
+ */
+static void parser_next_request(Parser *parser) {
+    parser->state = PARSER_STATE_STARTED;
     parser->marked_buffer = NULL;
     parser->marked_at = 0;
-    parser->marked_distance = 0;
-    parser->state = PARSER_STATE_STARTED;
+    parser->header_name = (String){0};
+    parser->body_size = 0;
+    parser->body_parsed = 0;
+    parser->body_chunked = false;
+    parser->body_streaming = false;
+    parser->chunk_size = 0;
+    parser->body_write_buffer = NULL;
+    parser->body_write_at = 0;
+    parser->stream_buffer = NULL;
+}
+
+/*
+ * Despues de PARSER_STATE_HEADERS_FINISHED: sigue con el body, juntandolo
+ * en request->body o devolviendolo de a pedazos en body_chunk.
+ */
+static void parser_begin_body(Parser *parser, bool streaming) {
+    parser->body_streaming = streaming;
+
+    if (parser->body_chunked) {
+        parser->state = PARSER_STATE_PARSING_CHUNK_SIZE_BEGIN;
+    } else {
+        parser->state = streaming ? PARSER_STATE_STREAMING_BODY : PARSER_STATE_PARSING_BODY_BEGIN;
+    }
+}
+
+/*
+ * Agrega los datos de un chunk al final del body que se viene juntando. El
+ * final siempre esta detras de lo que se parseo, asi que solo se pisan
+ * bytes que ya no hacen falta: los chunk-size y los \r\n entre chunks.
+ */
+static void parser_append_chunk(Parser *parser, u8 *data, u32 size) {
+    while (size > 0) {
+        Parser_Buffer *buffer = parser->body_write_buffer;
+
+        if (parser->body_write_at == buffer->used) {
+            parser->body_write_buffer = buffer->next;
+            parser->body_write_at = 0;
+            continue;
+        }
+
+        u32 space = buffer->used - parser->body_write_at;
+        u32 moved = size < space ? size : space;
+
+        memmove(buffer->data + parser->body_write_at, data, moved);
+
+        parser->body_write_at += moved;
+        data += moved;
+        size -= moved;
+    }
+}
+
+static inline i32 hex_digit_value(u8 c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
 }
 
-static char parser_get_char(Parser *parser) {
-    return parser->current_buffer->data[parser->at];
-}
+static void parser_parse_request(Parser *parser, Request *request) {
+    while (true) {
+
+        // se termino este buffer: se sigue con el del proximo read, si hay
+        if (parser->at == parser->current_buffer->used) {
+            if (parser->current_buffer->next == NULL) {
+                break;
+            }
+            parser->current_buffer = parser->current_buffer->next;
+            parser->at = 0;
+            continue;
+        }
+
+        char c = parser_get_char(parser);
+
+        switch (parser->state) {
+
+            case PARSER_STATE_STARTED: 
+
+                // casi siempre el head entero llega en un read
+                if (parser_parse_head(parser, request)) {
+                    return;
+                }
+
+                parser_mark(parser, parser->at);
+                parser->state = PARSER_STATE_PARSING_METHOD;
+
+                break;
+
+            case PARSER_STATE_PARSING_METHOD:
+
+                if (char_is(c, CHAR_CLASS_METHOD)) {
+                    parser->at = parser_skip_class(parser->current_buffer, parser->at + 1,
+                                                   parser->current_buffer->used, CHAR_CLASS_METHOD) - 1;
+                    break;
+                }
+
+                if (c != ' ') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                request->method = http_method_parse(parser_extract_block(parser, parser->at - 1));
+
+                if (request->method != HTTP_METHOD_UNKNOWN) {
+                    parser->state = PARSER_STATE_PARSING_SPACE_BEFORE_URI;
+                } else {
+                    parser->state = PARSER_STATE_FAILED;
+                }
+
+                break;
+
+            case PARSER_STATE_PARSING_SPACE_BEFORE_URI:
+
+                // no consume el caracter: el primero del URI tambien se valida
+                parser_mark(parser, parser->at);
+                parser->state = PARSER_STATE_PARSING_URI;
+
+                continue;
+
+            case PARSER_STATE_PARSING_URI:
+
+                if (char_is(c, CHAR_CLASS_URI)) {
+
+                    // saltea el resto de los caracteres validos del buffer
+                    parser->at = parser_skip_uri_chars(parser->current_buffer, parser->at + 1,
+                                                       parser->current_buffer->used) - 1;
+                    break;
+                }
+
+                bool uri_empty = parser->marked_buffer == parser->current_buffer &&
+                                 parser->marked_at == parser->at;
+
+                if (c != ' ' || uri_empty) {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                String uri = parser_extract_block(parser, parser->at - 1);
+
+                if (!request_set_uri(request, parser->arena, uri)) {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                parser->state = PARSER_STATE_PARSING_SPACE_BEFORE_VERSION;
+
+                break;
+
+            case PARSER_STATE_PARSING_SPACE_BEFORE_VERSION:
+
+                parser_mark(parser, parser->at);
+                parser->state = PARSER_STATE_PARSING_VERSION;
+
+                break;
+
+            case PARSER_STATE_PARSING_VERSION:
+
+                if (char_is(c, CHAR_CLASS_VERSION)) {
+                    break;
+                }
+
+                if (c != '\r') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                String version = parser_extract_block(parser, parser->at - 1);
+
+                if (!string_eq(version, HTTP_VERSION_10) && 
+                    !string_eq(version, HTTP_VERSION_11)
+                ) {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                request->version = version;
+
+                parser->state = PARSER_STATE_PARSING_END_OF_REQUEST_LINE;
+
+                break;
+
+            case PARSER_STATE_PARSING_END_OF_REQUEST_LINE:
+
+                if (c != '\n') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                parser->state = PARSER_STATE_PARSING_HEADER_KEY_BEGIN;
+
+                break;
+
+            case PARSER_STATE_PARSING_HEADER_KEY_BEGIN:
+
+                if (c == '\r') {
+                    parser->state = PARSER_STATE_PARSING_HEADERS_END;
+                    break;
+                }
+
+                if (!char_is(c, CHAR_CLASS_HEADER_NAME_START)) {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                parser_mark(parser, parser->at);
+                parser->state = PARSER_STATE_PARSING_HEADER_KEY;
+
+                break;
+
+            case PARSER_STATE_PARSING_HEADER_KEY:
+                
+                if (char_is(c, CHAR_CLASS_HEADER_NAME)) {
+                    parser->at = parser_skip_class(parser->current_buffer, parser->at + 1,
+                                                   parser->current_buffer->used, CHAR_CLASS_HEADER_NAME) - 1;
+                    break;
+                }
+
+                if (c != ':') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                String key = parser_extract_block(parser, parser->at - 1);
+                parser->header_name = parser_lower_in_place(key);
+                parser->header_kind = parser_known_header(parser->header_name);
+
+                parser->state = PARSER_STATE_PARSING_HEADER_SPACE;
+
+                break;
+
+            case PARSER_STATE_PARSING_HEADER_SPACE:
+
+                if (c != ' ') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
+
+                parser->state = PARSER_STATE_PARSING_HEADER_VALUE_BEGIN;
+
+                break;
+
+            case PARSER_STATE_PARSING_HEADER_VALUE_BEGIN:
+
+                if (c == '\r') {
+                    headers_put(&request->headers_map, parser->header_name, string_lit(""));
+                    parser->state = parser_set_known_header(parser, request, string_lit(""))
+                                  ? PARSER_STATE_PARSING_HEADER_VALUE_END : PARSER_STATE_FAILED;
+                } else {
+                    parser_mark(parser, parser->at);
+                    parser->state = PARSER_STATE_PARSING_HEADER_VALUE;
+                }
+
+                break;
+
+            case PARSER_STATE_PARSING_HEADER_VALUE:
+
+                if (c != '\r') {
+                    // salta directo al proximo '\r' del buffer
+                    parser->at = parser_find_cr(parser->current_buffer, parser->at + 1,
+                                                parser->current_buffer->used) - 1;
+                    break;
+                }
 
-static void parser_mark(Parser *parser, u32 at) {
-    parser->marked_buffer = parser->current_buffer;
-    parser->marked_distance = 0;
-    parser->marked_at = at;
-}
+                String value = parser_extract_block(parser, parser->at - 1);
+                
+                headers_put(&request->headers_map, parser->header_name, value);
 
-static String parser_extract_block(Parser *parser, u32 last_buffer_offset) {
+                if (!parser_set_known_header(parser, request, value)) {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
 
-    Parser_Buffer *first_buffer = parser->marked_buffer;
-    Parser_Buffer *last_buffer = parser->current_buffer;
+                parser->state = PARSER_STATE_PARSING_HEADER_VALUE_END;
 
-    u8 *first_buffer_offset = first_buffer->data + parser->marked_at;
+                break;
 
-    if (first_buffer == last_buffer) {
-        u32 total_size = last_buffer_offset - parser->marked_at + 1;
+            case PARSER_STATE_PARSING_HEADER_VALUE_END:
+                
+                if (c != '\n') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
 
-        void *data = arena_alloc(parser->arena, total_size);
+                parser->state = PARSER_STATE_PARSING_HEADER_KEY_BEGIN;
 
-        memcpy(data, first_buffer_offset, total_size);
+                break;
+                
+            case PARSER_STATE_PARSING_HEADERS_END:
 
-        String result = {
-            .data = data, 
-            .size = total_size
-        };
+                if (c != '\n') {
+                    parser->state = PARSER_STATE_FAILED;
+                    break;
+                }
 
-        return result;
-    }
+                parser_end_headers(parser, request);
 
-    u32 buffer_max_size = first_buffer->size;
-    u32 first_buffer_remaining_size = buffer_max_size - parser->marked_at;
-    u32 middle_buffers_size = parser->marked_distance * buffer_max_size;
-    u32 surplus_buffer_size = buffer_max_size - last_buffer_offset - 1;
+                // el tamanio maximo del body depende de la ruta, lo decide el que llama
+                if (parser->state == PARSER_STATE_HEADERS_FINISHED) {
+                    parser->at++;
+                    return;
+                }
 
-    u32 total_size = first_buffer_remaining_size + middle_buffers_size - surplus_buffer_size;
+                break;
 
-    void *data = arena_alloc(parser->arena, total_size);
-    void *next_memcpy = data;
+            case PARSER_STATE_PARSING_BODY_BEGIN:
 
-    memcpy(next_memcpy, first_buffer_offset, first_buffer_remaining_size);
-    next_memcpy += first_buffer_remaining_size;
+                parser_mark(parser, parser->at);
+                parser->body_parsed++;
 
-    Parser_Buffer *buffer;
+                if (parser->body_size == 1) {
+                    String body = parser_extract_block(parser, parser->at);
 
-    for (buffer = first_buffer->next; buffer != last_buffer; buffer = buffer->next) {
-        memcpy(next_memcpy, buffer->data, buffer_max_size);
-        next_memcpy += buffer_max_size;
-    }
+                    request->body.size = body.size;
+                    request->body.data = (u8 *)body.data;
 
-    memcpy(next_memcpy, buffer->data, last_buffer_offset + 1);
+                    parser->state = PARSER_STATE_FINISHED;
+                    break;
+                }
 
-    String result = {
-        .data = data,
-        .size = total_size
-    };
+                parser->state = PARSER_STATE_PARSING_BODY;
 
-    return result;
-}
+                break;
 
-static Parser_Buffer *parser_push_buffer(Parser *parser) {
-    void *memory = arena_alloc(parser->arena, 
-                        sizeof(Parser_Buffer) + MAX_PARSER_BUFFER_CAPACITY);
+            case PARSER_STATE_PARSING_BODY: {
 
-    Parser_Buffer *new_buffer = (Parser_Buffer *)memory;
-    new_buffer->size = MAX_PARSER_BUFFER_CAPACITY;
-    new_buffer->data = memory + sizeof(Parser_Buffer);
-    new_buffer->next = NULL;
+                u64 pending = parser->body_size - parser->body_parsed;
+                u32 remaining = parser->current_buffer->used - parser->at;
 
-    parser->at = 0;
-    parser->current_buffer = new_buffer;
-    parser->marked_distance++;
+                if (pending > remaining) {
+                    parser->at = parser->current_buffer->used;
+                    parser->body_parsed += remaining;
+                    continue;
+                }
 
-    if (parser->first_buffer == NULL && parser->last_buffer == NULL) {
-        parser->first_buffer = new_buffer;
-    } else {
-        parser->last_buffer->next = new_buffer;
-    }
-    parser->last_buffer = new_buffer;
+                parser->at += pending - 1;
+                parser->body_parsed += pending;
 
-    return new_buffer;
-}
+                String body = parser_extract_block(parser, parser->at);
+
+                request->body.size = body.size;
+                request->body.data = (u8 *)body.data;
 
-static u32 parser_parse_request(Parser *parser, Request *request) {
-    u32 parser_start_position = parser->at;
+                parser->state = PARSER_STATE_FINISHED;
 
-    while (parser->at < parser->bytes_read) {
+                break;
+            }
 
-        char c = parser_get_char(parser);
+            case PARSER_STATE_STREAMING_BODY: {
 
-        switch (parser->state) {
+                u64 pending = parser->body_size - parser->body_parsed;
+                u32 remaining = parser->current_buffer->used - parser->at;
+                u32 size = pending < remaining ? (u32)pending : remaining;
 
-            case PARSER_STATE_STARTED: 
+                parser->body_chunk = (String){
+                    .data = (char *)parser->current_buffer->data + parser->at,
+                    .size = size
+                };
 
-                parser_mark(parser, parser->at);
-                parser->state = PARSER_STATE_PARSING_METHOD;
+                parser->at += size;
+                parser->body_parsed += size;
 
-                break;
+                if (parser->body_parsed == parser->body_size) {
+                    parser->state = PARSER_STATE_FINISHED;
+                }
 
-            case PARSER_STATE_PARSING_METHOD:
+                // el que llama entrega el pedazo antes de seguir
+                return;
+            }
 
-                if (is_letter(c)) {
-                    break;
+            case PARSER_STATE_PARSING_CHUNK_SIZE_BEGIN: {
+
+                // sin streaming el body arranca donde estaba el primer chunk-size
+                if (!parser->body_streaming && parser->body_write_buffer == NULL) {
+                    parser_mark(parser, parser->at);
+                    parser->body_write_buffer = parser->current_buffer;
+                    parser->body_write_at = parser->at;
                 }
 
-                if (c != ' ') {
+                i32 digit = hex_digit_value(c);
+                if (digit < 0) {
                     parser->state = PARSER_STATE_FAILED;
                     break;
                 }
 
-                String method = parser_extract_block(parser, parser->at - 1);
+                parser->chunk_size = digit;
+                parser->state = PARSER_STATE_PARSING_CHUNK_SIZE;
+
+                break;
+            }
 
-                if (string_eq(method, string_lit("GET"))  ||
-                    string_eq(method, string_lit("PUT"))  ||
-                    string_eq(method, string_lit("POST")) ||
-                    string_eq(method, string_lit("DELETE"))) {
+            case PARSER_STATE_PARSING_CHUNK_SIZE: {
 
-                    request->method = method;
-                    request_add_segment_literal(request, parser->arena, method);
-                    parser->state = PARSER_STATE_PARSING_SPACE_BEFORE_URI;
+                i32 digit = hex_digit_value(c);
 
-                } else {
+                if (digit >= 0) {
+                    if (parser->chunk_size > (UINT64_MAX >> 4)) {
+                        parser->state = PARSER_STATE_FAILED;
+                        break;
+                    }
 
+                    parser->chunk_size = (parser->chunk_size << 4) | digit;
+                } else if (c == '\r') {
+                    parser->state = PARSER_STATE_PARSING_CHUNK_SIZE_END;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    parser->state = PARSER_STATE_PARSING_CHUNK_EXTENSION;
+                } else {
                     parser->state = PARSER_STATE_FAILED;
-                    
                 }
 
                 break;
+            }
 
-            case PARSER_STATE_PARSING_SPACE_BEFORE_URI:
+            case PARSER_STATE_PARSING_CHUNK_EXTENSION: {
 
-                parser_mark(parser, parser->at);
-                parser->state = PARSER_STATE_PARSING_URI;
+                // las extensiones no se usan, se saltean hasta el \r
+                u32 cr = parser_find_cr(parser->current_buffer, parser->at, parser->current_buffer->used);
+                if (cr == parser->current_buffer->used) {
+                    parser->at = cr;
+                    continue;
+                }
 
-                break;
+                parser->at = cr;
+                parser->state = PARSER_STATE_PARSING_CHUNK_SIZE_END;
 
-            case PARSER_STATE_PARSING_URI:
+                break;
+            }
 
-                if (is_alphanum(c) || c == '/' || c == '.' || c == '=' 
-                                   || c == '?' || c == '_' || c == '-'
-                                   || c == '&' || c == ',' ) {
+            case PARSER_STATE_PARSING_CHUNK_SIZE_END:
 
+                if (c != '\n') {
+                    parser->state = PARSER_STATE_FAILED;
                     break;
                 }
 
-                if (c != ' ') {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
+                parser->state = parser->chunk_size == 0 ? PARSER_STATE_PARSING_TRAILER_BEGIN
+                                                         : PARSER_STATE_PARSING_CHUNK_DATA;
+
+                break;
+
+            case PARSER_STATE_PARSING_CHUNK_DATA: {
+
+                u8 *data = parser->current_buffer->data + parser->at;
+                u32 remaining = parser->current_buffer->used - parser->at;
+                u32 size = parser->chunk_size < remaining ? (u32)parser->chunk_size : remaining;
+
+                parser->at += size;
+                parser->chunk_size -= size;
+                parser->body_parsed += size;
+
+                if (parser->chunk_size == 0) {
+                    parser->state = PARSER_STATE_PARSING_CHUNK_DATA_CR;
                 }
 
-                String uri = parser_extract_block(parser, parser->at - 1);
-                request->uri = uri;
+                if (parser->body_streaming) {
+                    parser->body_chunk = (String){ .data = (char *)data, .size = size };
+                    return;
+                }
 
-                request_add_uri_segments(request, parser->arena, uri);
+                parser_append_chunk(parser, data, size);
 
-                parser->state = PARSER_STATE_PARSING_SPACE_BEFORE_VERSION;
+                continue;
+            }
+
+            case PARSER_STATE_PARSING_CHUNK_DATA_CR:
+
+                parser->state = c == '\r' ? PARSER_STATE_PARSING_CHUNK_DATA_LF : PARSER_STATE_FAILED;
 
                 break;
 
-            case PARSER_STATE_PARSING_SPACE_BEFORE_VERSION:
+            case PARSER_STATE_PARSING_CHUNK_DATA_LF:
 
-                parser_mark(parser, parser->at);
-                parser->state = PARSER_STATE_PARSING_VERSION;
+                parser->state = c == '\n' ? PARSER_STATE_PARSING_CHUNK_SIZE_BEGIN : PARSER_STATE_FAILED;
 
                 break;
 
-            case PARSER_STATE_PARSING_VERSION:
+            case PARSER_STATE_PARSING_TRAILER_BEGIN:
 
-                if (c == 'H' ||
-                    c == 'T' ||
-                    c == 'P' ||
-                    c == '/' ||
-                    c == '1' ||
-                    c == '0' ||
-                    c == '.'
-                ) {
-                    break;
-                }
+                parser->state = c == '\r' ? PARSER_STATE_PARSING_TRAILERS_END : PARSER_STATE_PARSING_TRAILER;
 
-                if (c != '\r') {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
-                }
+                break;
 
-                String version = parser_extract_block(parser, parser->at - 1);
+            case PARSER_STATE_PARSING_TRAILER:
 
-                if (!string_eq(version, HTTP_VERSION_10) && 
-                    !string_eq(version, HTTP_VERSION_11)
-                ) {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
+                // los trailers se descartan
+                if (c == '\n') {
+                    parser->state = PARSER_STATE_PARSING_TRAILER_BEGIN;
                 }
 
-                request->version = version;
-
-                parser->state = PARSER_STATE_PARSING_END_OF_REQUEST_LINE;
-
                 break;
 
-            case PARSER_STATE_PARSING_END_OF_REQUEST_LINE:
+            case PARSER_STATE_PARSING_TRAILERS_END:
 
                 if (c != '\n') {
                     parser->state = PARSER_STATE_FAILED;
                     break;
                 }
 
-                parser->state = PARSER_STATE_PARSING_HEADER_KEY_BEGIN;
+                if (!parser->body_streaming && parser->body_parsed > 0) {
+                    String body = parser_extract_until(parser, parser->body_write_buffer,
+                                                       parser->body_write_at - 1);
+
+                    request->body.size = body.size;
+                    request->body.data = (u8 *)body.data;
+                }
+
+                parser->state = PARSER_STATE_FINISHED;
 
                 break;
 
-            case PARSER_STATE_PARSING_HEADER_KEY_BEGIN:
+            case PARSER_STATE_HEADERS_FINISHED:
+            case PARSER_STATE_FAILED:
+            case PARSER_STATE_FINISHED:
 
-                if (c == '\r') {
-                    parser->state = PARSER_STATE_PARSING_HEADERS_END;
-                    break;
-                }
+                return;
+
+            default: assert(1 && "assert: parser_parse_request: caso no contemplado");
+        }
+
+        parser->at++;
+    }
+}
+
+/*
+ * Camino rapido para el head entero (request line y headers) en el buffer
+ * actual, al estilo de picohttpparser: una sola pasada con un puntero, sin
+ * estados ni parser_mark, y como el \r\n\r\n del final esta en el buffer
+ * no hace falta fijarse a cada paso si se termino. Deja el request y el
+ * parser igual que la maquina de estados. Devuelve false sin tocar nada si
+ * el head quedo partido entre reads: ahi sigue la maquina de estados.
+ */
+static bool parser_parse_head(Parser *parser, Request *request) {
+    Parser_Buffer *buffer = parser->current_buffer;
+    u8 *data = buffer->data;
+
+    u32 head_end = parser_find_head_end(buffer, parser->at, buffer->used);
+    if (head_end == buffer->used) {
+        return false;
+    }
+
+    // end es la linea vacia: cada linea termina en un \r que esta a lo
+    // sumo en end, asi que los loops que frenan en el \r no se pasan
+    u8 *p = data + parser->at;
+    u8 *end = data + head_end + 2;
+    u8 *token;
+
+    token = p;
+    while (char_is(*p, CHAR_CLASS_METHOD)) {
+        p++;
+    }
+
+    if (*p != ' ') {
+        goto failed;
+    }
+
+    request->method = http_method_parse(string_with_len((char *)token, p - token));
+    if (request->method == HTTP_METHOD_UNKNOWN) {
+        goto failed;
+    }
+
+    token = ++p;
+    p = data + parser_skip_uri_chars(buffer, p - data, end - data);
+
+    if (*p != ' ' || p == token) {
+        goto failed;
+    }
+
+    if (!request_set_uri(request, parser->arena, string_with_len((char *)token, p - token))) {
+        goto failed;
+    }
+
+    token = ++p;
+    while (char_is(*p, CHAR_CLASS_VERSION)) {
+        p++;
+    }
+
+    String version = string_with_len((char *)token, p - token);
+
+    if (*p != '\r' || p[1] != '\n' ||
+        (!string_eq(version, HTTP_VERSION_10) && !string_eq(version, HTTP_VERSION_11))) {
+        goto failed;
+    }
+
+    request->version = version;
+    p += 2;
+
+    while (p < end) {
+
+        if (!char_is(*p, CHAR_CLASS_HEADER_NAME_START)) {
+            goto failed;
+        }
+
+        token = p;
+        p = data + parser_skip_class(buffer, p + 1 - data, end - data, CHAR_CLASS_HEADER_NAME);
+
+        if (*p != ':' || p[1] != ' ') {
+            goto failed;
+        }
+
+        parser->header_name = parser_lower_in_place(string_with_len((char *)token, p - token));
+        parser->header_kind = parser_known_header(parser->header_name);
+
+        token = p + 2;
+        p = data + parser_find_cr(buffer, token - data, end - data);
+
+        if (p[1] != '\n') {
+            goto failed;
+        }
+
+        String value = p > token ? string_with_len((char *)token, p - token) : string_lit("");
+
+        headers_put(&request->headers_map, parser->header_name, value);
+
+        if (!parser_set_known_header(parser, request, value)) {
+            goto failed;
+        }
+
+        p += 2;
+    }
+
+    parser->at = end + 2 - data;
+    parser_end_headers(parser, request);
+
+    return true;
+
+failed:
+    parser->state = PARSER_STATE_FAILED;
+    return true;
+}
+
+/*
+ * Devuelve la posicion del \r\n\r\n que termina el head en [from, to), o
+ * to si todavia no llego entero.
+ */
+static u32 parser_find_head_end(Parser_Buffer *buffer, u32 from, u32 to) {
+    u8 *data = buffer->data;
+
+    for (u32 i = parser_find_cr(buffer, from, to); i + 3 < to; i = parser_find_cr(buffer, i + 1, to)) {
+        if (data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n') {
+            return i;
+        }
+    }
+
+    return to;
+}
+
+/*
+ * Despues de la linea vacia: decide si hay body y como viene. Deja el
+ * parser en FINISHED, en HEADERS_FINISHED si hay body o en FAILED.
+ */
+static void parser_end_headers(Parser *parser, Request *request) {
+
+    // Transfer-Encoding ya se valido en parser_set_known_header, solo puede
+    // ser chunked. Si tambien vino content-length se ignora, pero puede ser
+    // un intento de request smuggling: RFC 9112, seccion 6.1, pide cerrar la
+    // conexion despues de responder.
+    if (request->transfer_encoding.data != NULL) {
+
+        if (request->content_length >= 0) {
+            request->content_length = -1;
+            request->connection = CONNECTION_TOKEN_CLOSE;
+        }
+
+        parser->body_chunked = true;
+        parser->state = PARSER_STATE_HEADERS_FINISHED;
+        return;
+    }
+
+    if (request->content_length > 0) {
+        parser->body_size = (u64)request->content_length;
+        parser->state = PARSER_STATE_HEADERS_FINISHED;
+        return;
+    }
+
+    parser->state = PARSER_STATE_FINISHED;
+}
+
+/*
+ * Interpreta el request-target (RFC 9112, seccion 3.2). Los caracteres ya
+ * los valido el parser; aca se validan los escapes y se arman los segmentos
+ * del path y los query params como vistas sobre el URI, sin decodificar:
+ * los %XX se decodifican recien cuando un handler pide el valor. Devuelve
+ * false si el URI no es valido.
+ */
+static bool request_set_uri(Request *request, Arena *arena, String uri) {
+    request->uri = uri;
+    request->arena = arena;
+
+    if (uri.size == 0 || !uri_check_escapes(uri)) {
+        return false;
+    }
+
+    String target = uri;
+
+    if (uri.data[0] == '/') {
 
-                if (!is_alphanum(c)) {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
-                }
+        request->uri_form = URI_FORM_ORIGIN;
 
-                parser_mark(parser, parser->at);
-                parser->state = PARSER_STATE_PARSING_HEADER_KEY;
+    } else if (request->method == HTTP_METHOD_CONNECT) {
 
-                break;
+        request->uri_form = URI_FORM_AUTHORITY;
+        request->host = uri;
+        return true;
 
-            case PARSER_STATE_PARSING_HEADER_KEY:
-                
-                if (is_alphanum(c) || c == '-' || c == '_') {
-                    break;
-                }
+    } else if (request->method == HTTP_METHOD_OPTIONS && uri.size == 1 && uri.data[0] == '*') {
 
-                if (c != ':') {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
-                }
+        request->uri_form = URI_FORM_ASTERISK;
+        return true;
 
-                String key = parser_extract_block(parser, parser->at - 1);
-                parser->header_name = string_to_lower(parser->arena, key);
+    } else {
 
-                parser->state = PARSER_STATE_PARSING_HEADER_SPACE;
+        // scheme "://" authority, y despues el path como en la forma origin
+        u32 i = 0;
+        while (i < uri.size && (is_alphanum(uri.data[i]) || uri.data[i] == '+' ||
+                                uri.data[i] == '-' || uri.data[i] == '.')) {
+            i++;
+        }
 
-                break;
+        if (i == 0 || !is_letter(uri.data[0]) || i + 3 > uri.size || memcmp(uri.data + i, "://", 3) != 0) {
+            return false;
+        }
 
-            case PARSER_STATE_PARSING_HEADER_SPACE:
+        u32 authority_start = i + 3;
+        u32 authority_end = authority_start;
+        while (authority_end < uri.size && uri.data[authority_end] != '/' && uri.data[authority_end] != '?') {
+            authority_end++;
+        }
 
-                if (c != ' ') {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
-                }
+        if (authority_end == authority_start) {
+            return false;
+        }
 
-                parser->state = PARSER_STATE_PARSING_HEADER_VALUE_BEGIN;
+        request->uri_form = URI_FORM_ABSOLUTE;
+        request->host = string_with_len(uri.data + authority_start, authority_end - authority_start);
+        target = string_with_len(uri.data + authority_end, uri.size - authority_end);
+    }
 
-                break;
+    const char *question = memchr(target.data, '?', target.size);
+    u32 path_size = question ? (u32)(question - target.data) : target.size;
 
-            case PARSER_STATE_PARSING_HEADER_VALUE_BEGIN:
+    // "http://host" y "http://host?q" son el path "/"
+    request->path = path_size > 0 ? string_with_len(target.data, path_size) : string_lit("/");
+    request->query = question ? string_with_len(question + 1, target.size - path_size - 1) : string_lit("");
 
-                if (c == '\r') {
-                    headers_put(&request->headers_map, parser->header_name, string_lit(""));
-                    parser->state = PARSER_STATE_PARSING_HEADER_VALUE_END;
-                } else {
-                    parser_mark(parser, parser->at);
-                    parser->state = PARSER_STATE_PARSING_HEADER_VALUE;
-                }
+    request->route_path = request_route_path(arena, request->path);
+    request_add_query_params(request, arena, request->query);
 
-                break;
+    return true;
+}
 
-            case PARSER_STATE_PARSING_HEADER_VALUE:
+/*
+ * El path que recorre el router. Los segmentos "." y ".." se resuelven aca
+ * (RFC 3986, seccion 5.2.4), asi "/static/../secret" nunca llega a una
+ * ruta como "/secret" con un segmento de mas; tambien cuentan escritos como
+ * %2E. Los %XX de unreserved quedan decodificados, ver
+ * uri_decode_unreserved. Casi ningun path tiene '%' ni segmentos que
+ * empiecen con '.', y entonces es el mismo path y no se copia nada.
+ */
+static String request_route_path(Arena *arena, String path) {
+    if (memchr(path.data, '%', path.size) == NULL && memmem(path.data, path.size, "/.", 2) == NULL) {
+        return path;
+    }
 
-                if (c != '\r') {
-                    break;
-                }
+    u8 *data = arena_alloc_aligned(arena, path.size, 1);
+    data[0] = '/';
+    u32 size = 1;
 
-                String value = parser_extract_block(parser, parser->at - 1);
-                
-                headers_put(&request->headers_map, parser->header_name, value);
+    u32 start = 1;
 
-                parser->state = PARSER_STATE_PARSING_HEADER_VALUE_END;
+    for (u32 i = 1; i <= path.size; i++) {
 
-                break;
+        if (i < path.size && path.data[i] != '/') {
+            continue;
+        }
 
-            case PARSER_STATE_PARSING_HEADER_VALUE_END:
-                
-                if (c != '\n') {
-                    parser->state = PARSER_STATE_FAILED;
-                    break;
-                }
+        bool is_last = i == path.size;
+        u32 segment_start = size;
+        size += uri_decode_unreserved(data + size, string_with_len(path.data + start, i - start));
+        start = i + 1;
 
-                parser->state = PARSER_STATE_PARSING_HEADER_KEY_BEGIN;
+        String segment = string_with_len((char *)data + segment_start, size - segment_start);
 
-                break;
-                
-            case PARSER_STATE_PARSING_HEADERS_END:
+        // si era el ultimo, el path termina en '/' como "/a/." -> "/a/"
+        if (string_eq(segment, string_lit("."))) {
+            size = segment_start;
+            continue;
+        }
 
-                if (c != '\n') {
-                    parser->state = PARSER_STATE_PARSING_HEADER_VALUE;
-                    break;
+        // "/.." no sube mas alla de la raiz
+        if (string_eq(segment, string_lit(".."))) {
+            size = segment_start;
+            if (size > 1) {
+                size--;
+                while (data[size - 1] != '/') {
+                    size--;
                 }
+            }
+            continue;
+        }
 
-                String *content_length = http_headers_get(&request->headers_map, string_lit("content-length"));
+        if (!is_last) {
+            data[size++] = '/';
+        }
+    }
 
-                if (content_length != NULL) {
+    return string_with_len((char *)data, size);
+}
 
-                    i64 body_size = string_to_i64(*content_length);
-                    if (body_size < 0 || body_size > MAX_BODY_SIZE) { 
-                        parser->state = PARSER_STATE_FAILED;
-                        break;
-                    } 
+/*
+ * Pares separados por '&'. Sin '=' el valor queda vacio y los pares vacios
+ * ("a=1&&b=2") se ignoran.
+ */
+static void request_add_query_params(Request *request, Arena *arena, String query) {
+    u32 pair_start = 0;
 
-                    if (body_size == 0) {
-                        parser->state = PARSER_STATE_FINISHED;
-                        break;
-                    }
+    for (u32 i = 0; i <= query.size; i++) {
 
-                    parser->body_size = (u32) body_size;
-                    parser->state = PARSER_STATE_PARSING_BODY_BEGIN;
-                    break;
-                }
+        if (i < query.size && query.data[i] != '&') {
+            continue;
+        }
 
-                parser->state = PARSER_STATE_FINISHED;
+        if (i > pair_start) {
+            String pair = string_with_len(query.data + pair_start, i - pair_start);
+            const char *equals = memchr(pair.data, '=', pair.size);
 
-                break;
+            String key = pair;
+            String value = string_lit("");
 
-            case PARSER_STATE_PARSING_BODY_BEGIN:
+            if (equals) {
+                key = string_with_len(pair.data, equals - pair.data);
+                value = string_with_len(equals + 1, pair.data + pair.size - equals - 1);
+            }
 
-                parser_mark(parser, parser->at);
-                parser->body_parsed++;
+            request_add_query_param(request, arena, key, value);
+        }
 
-                if (parser->body_size == 1) {
-                    String body = parser_extract_block(parser, parser->at);
+        pair_start = i + 1;
+    }
+}
 
-                    request->body.size = body.size;
-                    request->body.data = (u8 *)body.data;
+static void request_add_query_param(Request *request, Arena *arena, String key, String value) {
+    Query_Param *query_param = arena_alloc(arena, sizeof(Query_Param));
+    *query_param = (Query_Param){0};
+    query_param->next = NULL;
+    query_param->key = key;
+    query_param->value = value;
 
-                    parser->state = PARSER_STATE_FINISHED;
-                    break;
-                }
+    if (request->first_query_param == NULL && request->last_query_param == NULL) {
+        request->first_query_param = query_param;
+    } else {
+        request->last_query_param->next = query_param;
+    }
+    request->last_query_param = query_param;
+}
 
-                parser->state = PARSER_STATE_PARSING_BODY;
+/*
+ * Cada '%' tiene que tener dos digitos hexa atras (RFC 3986, seccion 2.1).
+ * Los URIs casi nunca tienen escapes, asi que se saltea de '%' en '%'.
+ */
+static bool uri_check_escapes(String uri) {
+    const char *end = uri.data + uri.size;
 
-                break;
+    for (const char *escape = memchr(uri.data, '%', uri.size);
+         escape != NULL;
+         escape = memchr(escape + 3, '%', end - escape - 3)) {
 
-            case PARSER_STATE_PARSING_BODY: {
+        if (end - escape < 3 || hex_digit_value(escape[1]) < 0 || hex_digit_value(escape[2]) < 0) {
+            return false;
+        }
+    }
 
-                u32 pending = parser->body_size - parser->body_parsed;
-                u32 remaining = parser->bytes_read - parser->at;
+    return true;
+}
 
-                if (pending > remaining) {
-                    parser->at = parser->bytes_read;
-                    parser->body_parsed += remaining;
-                    break;
-                }
+/*
+ * Decodifica los %XX (ya validados) y, en el query, '+' como espacio. Sin
+ * nada que decodificar devuelve la misma vista; si no, una copia en la
+ * arena, que vive lo mismo que el request.
+ */
+static String uri_decode(Arena *arena, String encoded, bool plus_as_space) {
+    bool has_escapes = memchr(encoded.data, '%', encoded.size) != NULL;
+    bool has_plus = plus_as_space && memchr(encoded.data, '+', encoded.size) != NULL;
 
-                parser->at += pending - 1;
-                parser->body_parsed += pending;
+    if (!has_escapes && !has_plus) {
+        return encoded;
+    }
 
-                String body = parser_extract_block(parser, parser->at);
+    u8 *data = arena_alloc_aligned(arena, encoded.size, 1);
+    u32 size = uri_decode_into(data, encoded, plus_as_space);
 
-                request->body.size = body.size;
-                request->body.data = (u8 *)body.data;
+    return string_with_len((char *)data, size);
+}
 
-                parser->state = PARSER_STATE_FINISHED;
+// Escribe lo decodificado en data y devuelve cuanto ocupa, que nunca es
+// mas que encoded. data puede ser encoded.data, para decodificar en el lugar.
+static u32 uri_decode_into(u8 *data, String encoded, bool plus_as_space) {
+    u32 size = 0;
 
-                break;
-            }
+    for (u32 i = 0; i < encoded.size; i++) {
+        u8 c = encoded.data[i];
 
-            case PARSER_STATE_FAILED:
-            case PARSER_STATE_FINISHED:
+        if (c == '%') {
+            c = hex_digit_value(encoded.data[i + 1]) << 4 | hex_digit_value(encoded.data[i + 2]);
+            i += 2;
+        } else if (c == '+' && plus_as_space) {
+            c = ' ';
+        }
 
-                return parser->at - parser_start_position;
+        data[size++] = c;
+    }
 
-            default: assert(1 && "assert: parser_parse_request: caso no contemplado");
+    return size;
+}
+
+/*
+ * Compara un componente del URI sin decodificar contra uno ya decodificado,
+ * sin copiar.
+ */
+static bool uri_component_eq(String encoded, String decoded, bool plus_as_space) {
+    u32 j = 0;
+
+    for (u32 i = 0; i < encoded.size; i++, j++) {
+        if (j == decoded.size) {
+            return false;
         }
 
-        parser->at++;
+        u8 c = encoded.data[i];
+
+        if (c == '%') {
+            c = hex_digit_value(encoded.data[i + 1]) << 4 | hex_digit_value(encoded.data[i + 2]);
+            i += 2;
+        } else if (c == '+' && plus_as_space) {
+            c = ' ';
+        }
+
+        if (c != (u8)decoded.data[j]) {
+            return false;
+        }
     }
 
-    return parser->at - parser_start_position;
+    return j == decoded.size;
 }
 
-static void request_add_uri_segments(Request *request, Arena *arena, String uri) {
+/*
+ * Decodifica solo los %XX de caracteres unreserved (RFC 3986 seccion 2.3),
+ * que significan lo mismo escapados o no: "us%65rs" es "users". Los demas
+ * quedan escapados, asi un %2F no se vuelve un separador y el router puede
+ * comparar los bytes contra los literales de las rutas. Escribe en data y
+ * devuelve cuanto ocupa, que nunca es mas que encoded.
+ */
+static u32 uri_decode_unreserved(u8 *data, String encoded) {
+    u32 size = 0;
 
-    u32 i = 1;
+    for (u32 i = 0; i < encoded.size; i++) {
+        u8 c = encoded.data[i];
 
-    { // Path segments
-    
-        // Si el path es unicamente: '/'
-        if (uri.data[0] == '/' && (uri.size == 1 || (uri.size > 1 && uri.data[1] == '?'))) {
+        if (c == '%') {
+            u8 decoded = hex_digit_value(encoded.data[i + 1]) << 4 | hex_digit_value(encoded.data[i + 2]);
 
-            request_add_segment_literal(request, arena, string_lit(""));
+            if (is_alphanum(decoded) || decoded == '-' || decoded == '.' || decoded == '_' || decoded == '~') {
+                c = decoded;
+                i += 2;
+            }
+        }
 
-        } else {
+        data[size++] = c;
+    }
 
-            u32 start = 1;
+    return size;
+}
 
-            while (i < uri.size && uri.data[i] != '?') {
+/*
+ * El nombre ya esta en minusculas. Con el tamanio queda a lo sumo un
+ * candidato, asi que alcanza con un memcmp para saber si es uno de los
+ * headers que usa el server.
+ */
+static Known_Header parser_known_header(String name) {
+    switch (name.size) {
+        case 4:
+            return memcmp(name.data, "host", 4) == 0 ? KNOWN_HEADER_HOST : KNOWN_HEADER_NONE;
+        case 6:
+            return memcmp(name.data, "expect", 6) == 0 ? KNOWN_HEADER_EXPECT : KNOWN_HEADER_NONE;
+        case 10:
+            return memcmp(name.data, "connection", 10) == 0 ? KNOWN_HEADER_CONNECTION : KNOWN_HEADER_NONE;
+        case 14:
+            return memcmp(name.data, "content-length", 14) == 0 ? KNOWN_HEADER_CONTENT_LENGTH : KNOWN_HEADER_NONE;
+        case 17:
+            return memcmp(name.data, "transfer-encoding", 17) == 0 ? KNOWN_HEADER_TRANSFER_ENCODING : KNOWN_HEADER_NONE;
+        default:
+            return KNOWN_HEADER_NONE;
+    }
+}
 
-                if (uri.data[i] == '/') {
-                    String segment = string_with_len(uri.data + start, i - start);
-                    request_add_segment_literal(request, arena, segment);
-                    start = i + 1;
-                }
+/*
+ * Guarda en el request el valor de un header conocido. Devuelve false si
+ * el valor no es valido y el request tiene que fallar.
+ */
+static bool parser_set_known_header(Parser *parser, Request *request, String value) {
+    switch (parser->header_kind) {
+        case KNOWN_HEADER_NONE:
+            break;
 
-                i++;
+        case KNOWN_HEADER_HOST:
+            // RFC 9112, seccion 3.2.2: con la forma absoluta vale el host del URI
+            if (request->uri_form != URI_FORM_ABSOLUTE && request->uri_form != URI_FORM_AUTHORITY) {
+                request->host = value;
             }
+            break;
 
-            if (uri.size > 1) {
+        case KNOWN_HEADER_EXPECT:
+            request->expect_continue = string_eq(parser_lower_in_place(value), string_lit("100-continue"));
+            break;
 
-                String segment;
+        case KNOWN_HEADER_CONNECTION:
+            request->connection = parser_connection_token(parser_lower_in_place(value));
+            break;
 
-                // Si el ultimo caracter leido fue un '/'
-                if (uri.data[i - 1] == '/') {
-                    segment = string_lit("");
-                } else {
-                    // Remanente
-                    segment = string_with_len(uri.data + start, i - start);
+        case KNOWN_HEADER_CONTENT_LENGTH: {
+            // solo digitos; 18 siempre entran en un i64
+            if (value.size == 0 || value.size > 18) {
+                return false;
+            }
+
+            i64 length = 0;
+            for (u32 i = 0; i < value.size; i++) {
+                u8 c = value.data[i];
+                if (c < '0' || c > '9') {
+                    return false;
                 }
+                length = length * 10 + (c - '0');
+            }
 
-                request_add_segment_literal(request, arena, segment);
+            // RFC 9110, seccion 8.6: varios content-length distintos son un error
+            if (request->content_length >= 0 && request->content_length != length) {
+                return false;
             }
+
+            request->content_length = length;
+            break;
         }
+
+        case KNOWN_HEADER_TRANSFER_ENCODING:
+            // varias lineas son una sola lista, y chunked no puede ir dos veces
+            if (request->transfer_encoding.data != NULL) {
+                return false;
+            }
+
+            request->transfer_encoding = parser_lower_in_place(value);
+            return parser_is_only_chunked(request->transfer_encoding);
     }
-    
-    { // Query params
-      
-        bool has_query_params = uri.data[i] == '?';
-        if (has_query_params) {
 
-            u32 key_pos = i + 1;
-            u32 value_pos = i + 1;
+    return true;
+}
+
+/*
+ * El valor de Transfer-Encoding es una lista de codings separadas por
+ * comas. chunked tiene que ser la ultima (RFC 9112, seccion 6.1) y es la
+ * unica que se sabe decodificar: con cualquier otra antes, como en
+ * "gzip, chunked", el handler recibiria un body que no puede leer, asi que
+ * solo vale chunked sola. Los elementos vacios de la lista no cuentan.
+ */
+static bool parser_is_only_chunked(String value) {
+    u32 codings_count = 0;
+    bool is_chunked = false;
+    u32 i = 0;
+
+    while (i < value.size) {
+        while (i < value.size && (value.data[i] == ',' || value.data[i] == ' ' || value.data[i] == '\t')) {
+            i++;
+        }
 
-            String query_key;
+        u32 start = i;
+        while (i < value.size && value.data[i] != ',' && value.data[i] != ' ' && value.data[i] != '\t') {
+            i++;
+        }
 
-            while (i < uri.size) {
+        String coding = { .data = value.data + start, .size = i - start };
+        if (coding.size == 0) {
+            continue;
+        }
 
-                char c = uri.data[i];
+        // entre la coding y la coma solo puede haber espacios
+        while (i < value.size && (value.data[i] == ' ' || value.data[i] == '\t')) {
+            i++;
+        }
+        if (i < value.size && value.data[i] != ',') {
+            return false;
+        }
 
-                if (c == '=') {
+        codings_count++;
+        is_chunked = string_eq(coding, string_lit("chunked"));
+    }
 
-                    query_key = string_with_len(uri.data + key_pos, i - key_pos);
+    return codings_count == 1 && is_chunked;
+}
 
-                    value_pos = i + 1;
+/*
+ * El valor de Connection es una lista de tokens separados por comas, por
+ * ejemplo "keep-alive, Upgrade". close gana sobre keep-alive.
+ */
+static Connection_Token parser_connection_token(String value) {
+    Connection_Token token = CONNECTION_TOKEN_OTHER;
+    u32 i = 0;
 
-                } else if (c == '&') {
+    while (i < value.size) {
+        while (i < value.size && (value.data[i] == ',' || value.data[i] == ' ' || value.data[i] == '\t')) {
+            i++;
+        }
 
-                    String query_value = string_with_len(uri.data + value_pos, i - value_pos);
-                    request_add_query_param(request, arena, query_key, query_value);
+        u32 start = i;
+        while (i < value.size && value.data[i] != ',' && value.data[i] != ' ' && value.data[i] != '\t') {
+            i++;
+        }
 
-                    key_pos = i + 1;
-                }
+        String item = { .data = value.data + start, .size = i - start };
 
-                i++;
-            }
+        if (string_eq(item, string_lit("close"))) {
+            return CONNECTION_TOKEN_CLOSE;
+        }
 
-            // Remanente
-            String query_value = string_with_len(uri.data + value_pos, i - value_pos);
-            request_add_query_param(request, arena, query_key, query_value);
+        if (string_eq(item, string_lit("keep-alive"))) {
+            token = CONNECTION_TOKEN_KEEP_ALIVE;
         }
     }
+
+    return token;
 }
 
-static void request_add_query_param(Request *request, Arena *arena, String key, String value) {
-    Query_Param *query_param = arena_alloc(arena, sizeof(Query_Param));
-    *query_param = (Query_Param){0};
-    query_param->next = NULL;
-    query_param->key = key;
-    query_param->value = value;
+/*
+ * Los metodos tienen a lo sumo 7 letras, asi que entran en un u64: se
+ * cargan de una vez y se compara contra constantes en vez de letra por
+ * letra. METHOD_WORD arma la constante como la deja memcpy en una maquina
+ * little-endian.
+ */
+#define METHOD_WORD(a, b, c, d, e, f, g) \
+    ((u64)(a) | (u64)(b) << 8 | (u64)(c) << 16 | (u64)(d) << 24 | \
+     (u64)(e) << 32 | (u64)(f) << 40 | (u64)(g) << 48)
 
-    if (request->first_query_param == NULL && request->last_query_param == NULL) {
-        request->first_query_param = query_param;
-    } else {
-        request->last_query_param->next = query_param;
+static Http_Method http_method_parse(String method) {
+    if (method.size < 3 || method.size > 7) {
+        return HTTP_METHOD_UNKNOWN;
     }
-    request->last_query_param = query_param;
-}
 
-static void request_add_segment_literal(Request *request, Arena *arena, String literal) {
-    Segment_Pattern *segment = arena_alloc(arena, sizeof(Segment_Pattern));
-    *segment = (Segment_Pattern){0};
-    segment->segment = literal;
-    segment->is_path_param = false;
+    u64 word = 0;
+    memcpy(&word, method.data, method.size);
 
-    if (request->first_segment == NULL && request->last_segment == NULL) {
-        request->first_segment = segment;
-    } else {
-        request->last_segment->next_segment = segment;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+
+    switch (word) {
+        case METHOD_WORD('G', 'E', 'T', 0, 0, 0, 0):           return HTTP_METHOD_GET;
+        case METHOD_WORD('H', 'E', 'A', 'D', 0, 0, 0):         return HTTP_METHOD_HEAD;
+        case METHOD_WORD('P', 'O', 'S', 'T', 0, 0, 0):         return HTTP_METHOD_POST;
+        case METHOD_WORD('P', 'U', 'T', 0, 0, 0, 0):           return HTTP_METHOD_PUT;
+        case METHOD_WORD('D', 'E', 'L', 'E', 'T', 'E', 0):     return HTTP_METHOD_DELETE;
+        case METHOD_WORD('C', 'O', 'N', 'N', 'E', 'C', 'T'):   return HTTP_METHOD_CONNECT;
+        case METHOD_WORD('O', 'P', 'T', 'I', 'O', 'N', 'S'):   return HTTP_METHOD_OPTIONS;
+        case METHOD_WORD('T', 'R', 'A', 'C', 'E', 0, 0):       return HTTP_METHOD_TRACE;
+        case METHOD_WORD('P', 'A', 'T', 'C', 'H', 0, 0):       return HTTP_METHOD_PATCH;
+        default:                                               return HTTP_METHOD_UNKNOWN;
     }
-    request->last_segment = segment;
 }
 
 static String http_status_reason(u16 status) {
@@ -1366,12 +5043,16 @@ static String http_status_reason(u16 status) {
         case 200: return string_lit("Ok");
         case 201: return string_lit("Created");
         case 400: return string_lit("Bad Request");
+        case 404: return string_lit("Not Found");
+        case 413: return string_lit("Content Too Large");
+        case 503: return string_lit("Service Unavailable");
         default: return string_lit("Unknown");
     }
 }
 
 static void request_init(Request *request) {
     *request = (Request){0};
+    request->content_length = -1;
     headers_init(&request->headers_map);
 }
 
@@ -1389,12 +5070,14 @@ void http_response_add_header(Response *response, String key, String value) {
     headers_put(&response->headers, key, value);
 }
 
+/*
+ * No copia content: la respuesta se codifica (y el body se copia a la
+ * arena de salida) cuando vuelve el handler, en el mismo thread que lo
+ * corrio, sea el worker o uno de offload. Hasta entonces content tiene que
+ * seguir valido: sirve la arena del request o memoria estatica, no el
+ * stack del handler.
+ */
 void http_response_write(Response *response, u8 *content, size_t size) {
-    // TODO: Deberia copiar la memoria o..
-    // que aca mismo se escriba a la conexion porque sino estoy liberando 
-    // la arena con la informacion ANTES de que se envie la data y podria
-    // llegar a ser pisada. Por ahora no pasa porque todo corre en el hilo
-    // principal
     response->body.data = content;
     response->body.size = size;
 }
@@ -1473,3 +5156,73 @@ String *http_headers_get(Headers_Map *headers_map, String name) {
     return NULL;
 }
 
+static Parser_Buffer *buffer_pool_get(Buffer_Pool *pool) {
+    if (pool->free_buffers == NULL) {
+        buffer_pool_grow(pool);
+    }
+
+    Parser_Buffer *buffer = pool->free_buffers;
+    pool->free_buffers = buffer->next;
+    pool->free_count--;
+
+    return buffer;
+}
+
+static void buffer_pool_put(Buffer_Pool *pool, Parser_Buffer *buffer) {
+    buffer->next = pool->free_buffers;
+    pool->free_buffers = buffer;
+    pool->free_count++;
+}
+
+/*
+ * Los buffers se reservan de a bloques, igual que las conexiones, y no se
+ * liberan: quedan en el pool para la proxima conexion.
+ */
+static void buffer_pool_grow(Buffer_Pool *pool) {
+    u64 headers_size = sizeof(Parser_Buffer) * PARSER_BUFFERS_BLOCK_SIZE;
+    u64 data_size = (u64)MAX_PARSER_BUFFER_CAPACITY * PARSER_BUFFERS_BLOCK_SIZE;
+
+    Arena *block = arena_make(headers_size + data_size + 2 * DEFAULT_ALIGNMENT);
+    Parser_Buffer *buffers = arena_alloc(block, headers_size);
+    u8 *data = arena_alloc(block, data_size);
+
+    for (u32 i = 0; i < PARSER_BUFFERS_BLOCK_SIZE; i++) {
+        buffers[i].data = data + (u64)i * MAX_PARSER_BUFFER_CAPACITY;
+        buffers[i].size = MAX_PARSER_BUFFER_CAPACITY;
+
+        buffer_pool_put(pool, &buffers[i]);
+    }
+
+    __atomic_store_n(&pool->buffers_count, pool->buffers_count + PARSER_BUFFERS_BLOCK_SIZE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Memoria residente del proceso. En linux sale de /proc/self/statm; macOS
+ * no la expone sin mach, asi que se usa el pico que da getrusage.
+ */
+static u64 process_rss_bytes(void) {
+#if OS_LINUX
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    u64 size_pages = 0;
+    u64 resident_pages = 0;
+    i32 matched = fscanf(file, "%lu %lu", &size_pages, &resident_pages);
+    fclose(file);
+
+    if (matched != 2) {
+        return 0;
+    }
+
+    return resident_pages * (u64)sysconf(_SC_PAGESIZE);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        return 0;
+    }
+
+    return (u64)usage.ru_maxrss; // en bytes en macOS
+#endif
+}
@@ -17,45 +17,114 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #if OS_MAC
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/resource.h>
 #else
+#include <linux/io_uring.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
 #endif
 
 #define HTTP_VERSION_10 string_lit("HTTP/1.0")
 #define HTTP_VERSION_11 string_lit("HTTP/1.1")
 
-#define MAX_CONNECTIONS 128
+#define LISTEN_BACKLOG SOMAXCONN
+#define CONNECTIONS_BLOCK_SIZE 1024
+#define CONTEXTS_BLOCK_SIZE 64
+#define CONTEXT_ARENA_SIZE 1 * MB
+#define CONTEXT_ARENA_HIGH_WATER_MARK 64 * KB // lo que queda residente de cada arena entre requests
+#define OUTPUT_HIGH_WATER_MARK 256 * KB
+#define OUTPUT_MAX_IOVECS 64
+
+#define TIMER_WHEEL_SLOTS 512 // potencia de 2
+#define TIMER_WHEEL_TICK_MS 100
+#define IDLE_TIMEOUT_MS 60 * 1000
+#define HEADERS_TIMEOUT_MS 10 * 1000
+#define BODY_TIMEOUT_MS 30 * 1000
+
+#define OFFLOAD_THREADS 4
+#define MAX_OFFLOAD_THREADS 64
+#define OFFLOAD_QUEUE_CAPACITY 1024
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS_COUNT 256
+#define MAX_WORKERS 64
 #define MAX_EVENTS 100
 #define MAX_PARSER_BUFFER_CAPACITY 8 * KB
+#define MAX_PARSER_BUFFERS 32 // por conexion: 256 KB entre el request en curso y los pipelined
+#define PARSER_BUFFERS_BLOCK_SIZE 32
+#define MIN_READ_SPACE 1 * KB // con menos lugar en el ultimo buffer se lee en otro
+#define MAX_COMPACT_SIZE 1 * KB // entre requests se mueve al principio hasta esto
 #define MAX_HEADERS_CAPACITY 32
-#define MAX_BODY_SIZE 4 * KB
+#define MAX_BODY_SIZE 4 * KB // sin streaming, ver http_server_handle_stream
+#define ROUTER_JUMP_TABLE_MIN_CHILDREN 8 // con menos hijos se recorren los primeros bytes
+#define ROUTE_MAX_PATH_PARAMS 8
+#define MAX_PATH_PARAM_NAMES 256 // distintos entre todas las rutas
+#define PATH_PARAM_ID_NONE 0xFFFFFFFF
+#define STATIC_ROUTES_MAX_DISPLACEMENT 1024 // si un bucket no entra se prueba con otra seed
 
 typedef struct Server Server;
+typedef struct Worker Worker;
+typedef struct Uring Uring;
+typedef struct Timer_Wheel Timer_Wheel;
+typedef struct Offload_Job Offload_Job;
+typedef struct Offload_Stats Offload_Stats;
+typedef struct Memory_Stats Memory_Stats;
+typedef struct Offload_Pool Offload_Pool;
+typedef struct Output_Chunk Output_Chunk;
 typedef struct Connection Connection;
+typedef struct Connection_Context Connection_Context;
 typedef struct Request Request;
 typedef struct Response Response;
 typedef struct Header Header;
 typedef struct Headers_Map Headers_Map;
 typedef struct Body Body;
 typedef struct Parser_Buffer Parser_Buffer;
+typedef struct Buffer_Pool Buffer_Pool;
 typedef struct Parser Parser;
 typedef struct Pattern_Parser Pattern_Parser;
 typedef struct Segment_Pattern Segment_Pattern;
+typedef struct Route Route;
+typedef struct Route_Node Route_Node;
+typedef struct Route_Builder_Node Route_Builder_Node;
+typedef struct Path_Param Path_Param;
+typedef struct Catch_All_Match Catch_All_Match;
+typedef struct Router Router;
+typedef struct Static_Route Static_Route;
+typedef struct Static_Routes Static_Routes;
 typedef struct Query_Param Query_Param;
 
 typedef enum Connection_State Connection_State;
 typedef enum Parse_Error Parse_Error;
 typedef enum Parser_State Parser_State;
 typedef enum Pattern_Parser_State Pattern_Parser_State;
+typedef enum Events_Flags Events_Flags;
+typedef enum Events_Backend Events_Backend;
+typedef enum Events_Interest Events_Interest;
+typedef enum Timeout_Kind Timeout_Kind;
+typedef enum Handler_Flags Handler_Flags;
+typedef enum Char_Class Char_Class;
+typedef enum Http_Method Http_Method;
+typedef enum Known_Header Known_Header;
+typedef enum Connection_Token Connection_Token;
+typedef enum Uri_Form Uri_Form;
 
 typedef void Http_Handler(Request *req, Response *res);
+typedef void Http_Body_Handler(Request *req, u8 *data, size_t size);
 
 enum Parser_State {
     PARSER_STATE_STARTED,
@@ -74,14 +143,45 @@ enum Parser_State {
     PARSER_STATE_PARSING_HEADER_VALUE,
     PARSER_STATE_PARSING_HEADER_VALUE_END,
     PARSER_STATE_PARSING_HEADERS_END,
+    PARSER_STATE_HEADERS_FINISHED, // hay body: el que llama elige como leerlo, ver parser_begin_body
 
+    // todos los estados del body van entre PARSING_BODY_BEGIN y FINISHED
     PARSER_STATE_PARSING_BODY_BEGIN,
     PARSER_STATE_PARSING_BODY,
+    PARSER_STATE_STREAMING_BODY,
+
+    // Transfer-Encoding: chunked
+    PARSER_STATE_PARSING_CHUNK_SIZE_BEGIN,
+    PARSER_STATE_PARSING_CHUNK_SIZE,
+    PARSER_STATE_PARSING_CHUNK_EXTENSION,
+    PARSER_STATE_PARSING_CHUNK_SIZE_END,
+    PARSER_STATE_PARSING_CHUNK_DATA,
+    PARSER_STATE_PARSING_CHUNK_DATA_CR,
+    PARSER_STATE_PARSING_CHUNK_DATA_LF,
+    PARSER_STATE_PARSING_TRAILER_BEGIN,
+    PARSER_STATE_PARSING_TRAILER,
+    PARSER_STATE_PARSING_TRAILERS_END,
 
     PARSER_STATE_FINISHED,
     PARSER_STATE_FAILED
 };
 
+enum Events_Flags {
+    EVENTS_FLAG_NONE           = 0,
+    EVENTS_FLAG_EDGE_TRIGGERED = 1 << 0,
+    EVENTS_FLAG_EXCLUSIVE      = 1 << 1, // solo epoll
+};
+
+enum Events_Interest {
+    EVENTS_INTEREST_READ  = 1 << 0,
+    EVENTS_INTEREST_WRITE = 1 << 1,
+};
+
+enum Events_Backend {
+    EVENTS_BACKEND_EPOLL,    // kqueue en macOS
+    EVENTS_BACKEND_IO_URING, // solo linux
+};
+
 enum Pattern_Parser_State {
     PATTERN_PARSER_STATE_STARTED,
     PATTERN_PARSER_STATE_PARSING_SLASH,
@@ -91,23 +191,177 @@ enum Pattern_Parser_State {
     PATTERN_PARSER_STATE_FINISHED
 };
 
-struct Segment_Pattern {
-    Http_Handler *handler;
+enum Handler_Flags {
+    HANDLER_FLAG_NONE     = 0,
+    HANDLER_FLAG_BLOCKING = 1 << 0, // corre en el pool de offload, no en el event loop
+};
+
+// RFC 9110, seccion 9
+enum Http_Method {
+    HTTP_METHOD_UNKNOWN,
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_CONNECT,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_TRACE,
+    HTTP_METHOD_PATCH,
+    HTTP_METHODS_COUNT
+};
+
+// headers que el parser reconoce al terminar el nombre y guarda en Request
+enum Known_Header {
+    KNOWN_HEADER_NONE,
+    KNOWN_HEADER_HOST,
+    KNOWN_HEADER_EXPECT,
+    KNOWN_HEADER_CONNECTION,
+    KNOWN_HEADER_CONTENT_LENGTH,
+    KNOWN_HEADER_TRANSFER_ENCODING,
+};
+
+enum Connection_Token {
+    CONNECTION_TOKEN_NONE, // no vino el header
+    CONNECTION_TOKEN_KEEP_ALIVE,
+    CONNECTION_TOKEN_CLOSE,
+    CONNECTION_TOKEN_OTHER, // por ejemplo "upgrade"
+};
+
+// formas del request-target, RFC 9112 seccion 3.2
+enum Uri_Form {
+    URI_FORM_ORIGIN,    // /path?query, la de casi todos los requests
+    URI_FORM_ABSOLUTE,  // http://host/path?query, el host sale de aca y no del header
+    URI_FORM_AUTHORITY, // host:port, solo con CONNECT
+    URI_FORM_ASTERISK,  // *, solo con OPTIONS
+};
+
+// un bit por clase en la tabla char_classes del parser
+enum Char_Class {
+    CHAR_CLASS_METHOD            = 1 << 0, // letras
+    CHAR_CLASS_URI               = 1 << 1, // RFC 3986: unreserved, sub-delims, : @ / ? y %
+    CHAR_CLASS_VERSION           = 1 << 2, // H T P / 1 0 .
+    CHAR_CLASS_HEADER_NAME_START = 1 << 3, // alfanumericos
+    CHAR_CLASS_HEADER_NAME       = 1 << 4, // alfanumericos y - _
+};
 
+struct Segment_Pattern {
     Segment_Pattern *next_segment;
+
+    String segment; // en un param, el nombre sin las llaves ni el '*'
+    bool is_path_param;
+    bool is_catch_all; // {*name}: se lleva el resto del path, solo puede ser el ultimo
+};
+
+// una ruta de http_server_handle, con sus segmentos tal cual los parseo el pattern parser
+struct Route {
+    Route *next;
+    Http_Method method;
     Segment_Pattern *first_segment;
-    Segment_Pattern *last_segment;
-    Segment_Pattern *child_segments;
 
-    String segment;
+    // Cada param tiene el slot de su posicion en el pattern y el id de su
+    // nombre, que es el mismo en todas las rutas del server.
+    u32 path_params_count;
+    String path_param_names[ROUTE_MAX_PATH_PARAMS];
+    u32 path_param_ids[ROUTE_MAX_PATH_PARAMS];
 
-    bool is_path_param;
-    String path_param_name;
+    Http_Handler *handler;
+    Http_Body_Handler *body_handler; // si no es NULL el body llega en streaming
+    u32 handler_flags;
+};
+
+/*
+ * Nodo del radix trie compilado. Cada nodo tiene el pedazo del path que
+ * consume (su prefijo, en Router.bytes) y sus hijos literales, ordenados
+ * por primer byte, en Router.first_bytes y Router.children a partir de
+ * children_start. Un hijo param consume un segmento entero y un catch_all
+ * el resto del path.
+ */
+struct Route_Node {
+    u32 prefix_start;
+    u32 prefix_size;
+    u32 children_start;
+    u16 children_count;
+    u16 jump_table;   // 0 si no tiene, si no la posicion + 1 en Router.jump_tables
+    u32 param_child;  // 0 si no tiene: la raiz nunca es hija
+    Route *route;     // la ruta que termina en este nodo
+    Route *catch_all; // la ruta con {*name} despues de este nodo, si no matchea nada mas
+};
+
+/*
+ * Las rutas de un metodo, compiladas en http_server_start. Todo esta en
+ * arrays contiguos: los nodos, los bytes de los prefijos, y el primer byte
+ * y el indice de cada hijo. Los nodos con muchos hijos tienen ademas una
+ * tabla de 256 entradas indexada por el primer byte.
+ */
+struct Router {
+    Route_Node *nodes;
+    u32 nodes_count;
+    u8 *bytes;
+    u32 bytes_count;
+    u8 *first_bytes;
+    u32 *children;
+    u32 children_count;
+    u8 *jump_tables; // 256 por tabla: posicion + 1 del hijo entre los del nodo, 0 si no hay
+    u32 jump_tables_count;
+};
+
+// una ruta sin params en Static_Routes, route es NULL si el slot esta libre
+struct Static_Route {
+    Route *route;
+    Http_Method method;
+    u32 path_start; // en Static_Routes.bytes
+    u32 path_size;
+};
+
+/*
+ * Las rutas sin params de todos los metodos, en una tabla de hash perfecto
+ * por metodo y path (hash and displace). El hash elige un bucket, y el hash
+ * con el desplazamiento de ese bucket elige el slot. Los desplazamientos se
+ * buscan al armar la tabla para que ningun par de rutas comparta slot, asi
+ * que buscar es un hash y una sola comparacion.
+ */
+struct Static_Routes {
+    Static_Route *slots;
+    u32 slots_mask;
+    u32 *displacements;
+    u32 buckets_mask;
+    u64 seed;
+    u8 *bytes;
+    u64 path_sizes; // bit n: hay una ruta con un path de n bytes, las de 63 o mas comparten el bit 63
+};
+
+// el trie mientras se arma, antes de compactarlo en un Router
+struct Route_Builder_Node {
+    String prefix;
+    Route_Builder_Node *first_child; // ordenados por primer byte
+    Route_Builder_Node *next_sibling;
+    Route_Builder_Node *param_child;
+    Route *route;
+    Route *catch_all;
+};
+
+// un path param como posicion en Request.route_path
+struct Path_Param {
+    u32 offset;
+    u32 size;
+    bool is_decoded;
+};
+
+// el {*name} que mas path se come de los que se cruzaron buscando una ruta,
+// con los params que tenia el request al pasar por el
+struct Catch_All_Match {
+    Route *route;
+    u32 at;
+    u32 path_params_count;
+    Path_Param path_params[ROUTE_MAX_PATH_PARAMS];
 };
 
 struct Pattern_Parser {
     Pattern_Parser_State state;
 
+    Http_Method method;
+
     Segment_Pattern *first_segment;
     Segment_Pattern *last_segment;
 };
@@ -116,26 +370,56 @@ struct Parser_Buffer {
     Parser_Buffer *next;
     u8 *data;
     u32 size;
+    u32 used; // bytes que trajeron los reads, puede ser menos que size
+};
+
+/*
+ * Buffers de recepcion de un worker. Una conexion los pide a medida que
+ * lee y los devuelve entre requests, cuando ya no tienen bytes sin
+ * parsear, asi que se reusan entre conexiones: la memoria depende de los
+ * requests en curso y no de cuantos reads hubo.
+ */
+struct Buffer_Pool {
+    Parser_Buffer *free_buffers;
+    u32 buffers_count;
+    u32 free_count;
 };
 
 struct Parser {
     Arena *arena;
+    Buffer_Pool *pool;
 
     Parser_State state;
 
-    i32 bytes_read;
     Parser_Buffer *first_buffer;
     Parser_Buffer *last_buffer;
     Parser_Buffer *current_buffer;
     u32 at;
+    u32 buffers_count;
 
     Parser_Buffer *marked_buffer;
     u32 marked_at;
-    u32 marked_distance;
 
     String header_name;
-    u32 body_size;
-    u32 body_parsed;
+    Known_Header header_kind;
+    u64 body_size; // 0 si es chunked, no se sabe hasta el final
+    u64 body_parsed;
+    bool body_chunked;
+    bool body_streaming;
+
+    // Lo que falta del chunk actual. Sin streaming los datos de cada chunk
+    // se mueven dentro de los buffers hasta body_write_buffer/body_write_at,
+    // pisando los chunk-size ya parseados, y el body queda contiguo.
+    u64 chunk_size;
+    Parser_Buffer *body_write_buffer;
+    u32 body_write_at;
+
+    // En streaming cada llamada a parser_parse_request devuelve en
+    // body_chunk lo que llego del body, como vista sobre el buffer.
+    // stream_buffer es el primer buffer que solo tiene body: una vez
+    // entregado se reusa para el proximo read.
+    String body_chunk;
+    Parser_Buffer *stream_buffer;
 };
 
 struct Header {
@@ -155,24 +439,51 @@ struct Body {
     size_t size;
 };
 
+/*
+ * key y value son vistas sobre el URI con los %XX sin decodificar. El value
+ * se decodifica la primera vez que lo pide un handler.
+ */
 struct Query_Param {
     Query_Param *next;
     String key;
     String value;
+    bool is_decoded;
 };
 
 struct Request {
-    String method;
-
-    String uri;
-    Segment_Pattern *first_segment;
-    Segment_Pattern *last_segment;
+    Http_Method method;
+
+    String uri; // tal cual vino, con los %XX
+    Uri_Form uri_form;
+    String path; // sin el query; en la forma absoluta, sin scheme ni host
+    String query; // sin el '?'
+    // El path sin segmentos . y .. y con los %XX de unreserved decodificados,
+    // ver request_route_path. Casi siempre es el mismo que path.
+    String route_path;
+    // la ruta que matcheo: los nombres de los params salen de su pattern
+    Route *route;
+    Path_Param path_params[ROUTE_MAX_PATH_PARAMS];
+    u32 path_params_count;
     Query_Param *first_query_param;
     Query_Param *last_query_param;
 
     String version;
     Headers_Map headers_map;
     Body body;
+
+    // Los headers que usa el server, ya interpretados por el parser.
+    // Tambien quedan en headers_map.
+    i64 content_length; // -1 si no vino
+    Connection_Token connection;
+    bool expect_continue;
+    String host;
+    String transfer_encoding;
+
+    // libre para el handler, por ejemplo para ir guardando un body en streaming
+    void *user_data;
+
+    // la del parser, para decodificar los params cuando se piden
+    Arena *arena;
 };
 
 struct Response {
@@ -183,48 +494,302 @@ struct Response {
 
 enum Connection_State {
     CONNECTION_STATE_ACTIVE,
+    CONNECTION_STATE_CLOSING,
     CONNECTION_STATE_FAILED
 };
 
-struct Connection {
+struct Output_Chunk {
+    Output_Chunk *next;
+    String data;
+    u8 arena; // en cual de las output_arenas esta
+};
+
+/*
+ * Todo lo necesario para procesar bytes de una conexion: la arena, el
+ * parser y el request. Solo se le asigna a una Connection mientras tiene un
+ * request en curso; una conexion keep-alive ociosa no tiene contexto.
+ */
+struct Connection_Context {
+    // Todo lo del request en curso, se reinicia entre requests. Los bytes
+    // recibidos estan aparte, en buffers del pool del worker.
     Arena *arena;
+    // Respuestas codificadas. Se alternan dos arenas: las respuestas nuevas
+    // van a una mientras la otra termina de enviarse, y cada una se reinicia
+    // cuando se mandaron todos sus chunks. Asi un cliente que no deja de
+    // mandar requests pipelined no hace crecer la salida sin limite.
+    Arena *output_arenas[2];
+    u32 output_chunks[2];
+    u8 output_arena;
+
+    Connection_Context *next_free;
+
+    Request request;
+
+    Parser parser;
+
+    // la ruta se busca al terminar los headers si el request tiene body
+    Route *route;
+
+    // respuestas codificadas que todavia no se enviaron
+    Output_Chunk *first_output;
+    Output_Chunk *last_output;
+    u64 output_size;
+    u32 sends_in_flight;
+};
+
+/*
+ * Que esta esperando la conexion, define cual de los timeouts se aplica.
+ */
+enum Timeout_Kind {
+    TIMEOUT_KIND_NONE,
+    TIMEOUT_KIND_IDLE,    // keep-alive sin request en curso (o esperando que lea la respuesta)
+    TIMEOUT_KIND_HEADERS, // llego parte del request line o los headers
+    TIMEOUT_KIND_BODY,    // llegaron los headers y falta el body
+};
 
+/*
+ * Estado minimo de una conexion abierta. Tiene que ser chico porque se
+ * mantienen muchas conexiones keep-alive ociosas al mismo tiempo.
+ */
+struct Connection {
     Connection_State state;
 
     i32 fd;
-    String host;
-    u16 port;
     struct sockaddr_in address;
 
     bool is_active;
     bool keep_alive;
+    bool recv_armed; // io_uring: hay un recv multishot pendiente
+    u8 events_interest;
+
+    union {
+        Connection_Context *context;
+        Connection *next_free;
+    };
+
+    // Nodo en el Timer_Wheel del worker. timer_pprev apunta al puntero que
+    // apunta a esta conexion (el slot o el timer_next anterior), asi sacarla
+    // es O(1). Es NULL si la conexion no esta en el wheel.
+    Connection *timer_next;
+    Connection **timer_pprev;
+    u32 timer_deadline; // en ticks del wheel
+    u8 timeout_kind;
+
+    // el request esta en el pool de offload: mientras tanto no se lee ni se
+    // libera la conexion
+    bool waiting_offload;
+};
 
-    Request request;
+/*
+ * Timer wheel con un slot por tick. Cada conexion esta en un unico slot y
+ * extender su deadline es solo escribir timer_deadline: recien cuando le
+ * toca el turno a su slot se fija si vencio o se vuelve a insertar mas
+ * adelante. Los deadlines que no entran en una vuelta del wheel van al
+ * ultimo slot y se reinsertan al pasar por el.
+ */
+struct Timer_Wheel {
+    u64 start_ms;
+    u32 current_tick;
+    u32 timers_count;
+    Connection *slots[TIMER_WHEEL_SLOTS];
+};
 
-    Parser parser;
+#if OS_LINUX
+/*
+ * Backend de io_uring. Los rings se mapean a mano con las syscalls, sin
+ * liburing. Los recv usan un ring de buffers provistos (buffers_ring): el
+ * kernel elige un buffer libre, se copian los bytes al Parser_Buffer de la
+ * conexion y el buffer se devuelve al ring.
+ */
+struct Uring {
+    i32 fd;
+
+    u32 *sq_head;
+    u32 *sq_tail;
+    u32 sq_mask;
+    u32 sq_entries;
+    u32 sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    u32 *cq_head;
+    u32 *cq_tail;
+    u32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buffers_ring;
+    u8 *buffers;
+    u16 buffers_tail;
+
+    u64 wakeup_value;
+
+    struct __kernel_timespec tick_timeout;
 };
+#endif
 
-struct Server {
-    Arena *arena;
+/*
+ * Un request cuyo handler es bloqueante. Vive en la arena del contexto de
+ * la conexion, que no se toca desde el event loop hasta que vuelve.
+ */
+struct Offload_Job {
+    Offload_Job *next;
+
+    Worker *worker;
+    Connection *connection;
+    Http_Handler *handler;
+
+    u64 queued_ns;
+
+    // la respuesta ya codificada, lista para encolar en la conexion
+    String output;
+};
+
+/*
+ * Foto de la memoria del server para dimensionar las maquinas. Los
+ * contadores los actualiza cada worker y se leen sin lock, asi que pueden
+ * estar desfasados entre si por unos pocos requests.
+ */
+struct Memory_Stats {
+    u64 rss_bytes; // de todo el proceso; en macOS es el pico
+    u32 connections_open;
+    u32 contexts_count; // reservados, en uso o en las free lists
+    u32 contexts_in_use; // conexiones con un request o una respuesta en curso
+    u64 receive_buffers_bytes; // los Parser_Buffer de los pools de los workers
+    u64 rss_per_connection; // 0 sin conexiones abiertas
+};
+
+struct Offload_Stats {
+    u64 jobs_completed;
+    u64 jobs_rejected; // cola llena, se respondio 503
+    u32 queue_depth;
+    u32 max_queue_depth;
+    u64 total_wait_ns; // desde que se encola hasta que lo toma un thread
+    u64 max_wait_ns;
+};
+
+/*
+ * Threads para los handlers bloqueantes (HANDLER_FLAG_BLOCKING). Los jobs
+ * entran por una cola acotada con mutex y vuelven al worker que los mando
+ * por su cola de completados, que es lock-free.
+ */
+struct Offload_Pool {
+    u32 threads_count;
+    u32 threads_started;
+    pthread_t threads[MAX_OFFLOAD_THREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    Offload_Job *first_job;
+    Offload_Job *last_job;
+    bool stopping;
+
+    Offload_Stats stats;
+};
+
+/*
+ * Cada worker corre su propio event loop en un thread: tiene su socket de
+ * escucha (SO_REUSEPORT), su instancia de epoll/kqueue y su porcion de las
+ * conexiones. Lo unico que comparten son las rutas, que despues de
+ * http_server_start es de solo lectura.
+ */
+struct Worker {
+    Server *server;
+
+    u32 id;
+    pthread_t thread;
 
     i32 fd;
 
+    Events_Backend backend;
+
     i32 events_fd;
+    u32 events_flags;
+
+#if OS_LINUX
+    Uring uring;
+#endif
+
+    Timer_Wheel timers;
 
+    // Para despertar al event loop, por ejemplo al apagar el server o cuando
+    // vuelve un job del pool. En linux es un eventfd (los dos fds son el
+    // mismo), en macOS un pipe.
+    i32 wakeup_fds[2];
+
+    // Jobs de offload terminados. Los threads del pool los apilan con CAS y
+    // el worker se lleva toda la pila de una vez.
+    Offload_Job *completed_jobs;
+
+    // Las conexiones y los contextos se reservan de a bloques y crecen a
+    // medida que hacen falta. Los que no estan en uso quedan en su free list.
     u32 connections_count;
-    Connection *connections;
+    Connection *free_connections;
+
+    u32 contexts_count;
+    Connection_Context *free_contexts;
+
+    // para http_server_get_memory_stats
+    u32 connections_open;
+    u32 contexts_in_use;
+
+    Buffer_Pool buffers;
+};
+
+struct Server {
+    Arena *arena;
 
-    Segment_Pattern *patterns_tree;
+    u32 workers_count;
+    Worker *workers;
+
+    bool reuse_port;
+    bool edge_triggered;
+    Events_Backend backend;
+    u64 output_high_water_mark;
+    u64 arena_high_water_mark;
+
+    // 0 desactiva el timeout
+    u32 idle_timeout_ms;
+    u32 headers_timeout_ms;
+    u32 body_timeout_ms;
+
+    Offload_Pool offload;
+    bool has_blocking_handlers;
+
+    // Las rutas en el orden en que se registraron. http_server_start las
+    // compila en un router por metodo y despues no se pueden agregar mas.
+    Route *first_route;
+    Route *last_route;
+    bool routes_frozen;
+    Static_Routes static_routes; // se busca primero, antes del router
+    Router routers[HTTP_METHODS_COUNT];
+
+    // los nombres de los path params, el id de cada uno es su posicion
+    String path_param_names[MAX_PATH_PARAM_NAMES];
+    u32 path_param_names_count;
 };
 
 Server *http_server_make(Arena *arena);
+void http_server_set_workers(Server *server, u32 workers_count);
+void http_server_set_edge_triggered(Server *server, bool edge_triggered);
+void http_server_set_reuse_port(Server *server, bool reuse_port);
+void http_server_set_backend(Server *server, Events_Backend backend);
+void http_server_set_output_high_water_mark(Server *server, u64 bytes);
+void http_server_set_arena_high_water_mark(Server *server, u64 bytes);
+void http_server_set_timeouts(Server *server, u32 idle_ms, u32 headers_ms, u32 body_ms);
+void http_server_set_offload_threads(Server *server, u32 threads_count);
 void http_server_handle(Server *server, char *pattern, Http_Handler *handler);
+void http_server_handle_with_flags(Server *server, char *pattern, Http_Handler *handler, u32 flags);
+void http_server_handle_stream(Server *server, char *pattern, Http_Body_Handler *body_handler, Http_Handler *handler, u32 flags);
+Offload_Stats http_server_get_offload_stats(Server *server);
+Memory_Stats http_server_get_memory_stats(Server *server);
+u32 http_server_path_param_id(Server *server, char *name);
 i32 http_server_start(Server *server, u32 port, char *host);
 
 Body http_request_get_body(Request *request);
 Headers_Map http_request_get_headers(Request *request);
 String http_request_get_header(Request *request, String name);
 String http_request_get_path_param(Request *request, String name);
+String http_request_get_path_param_at(Request *request, u32 slot);
+String http_request_get_path_param_by_id(Request *request, u32 id);
 String http_request_get_query_param(Request *request, String name);
 
 void http_response_set_status(Response *response, u32 status);
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "gg_stdlib.h"
 
 #include "http.h"
@@ -82,7 +84,8 @@ int main(int argc, char *argv[], char *env[]) {
 
     Server *server = http_server_make(arena);
 
-    http_server_handle(server, "GET /", &handle_strange_configs);
+    // lee un archivo en cada request, no puede frenar al event loop
+    http_server_handle_with_flags(server, "GET /", &handle_strange_configs, HANDLER_FLAG_BLOCKING);
 
     return http_server_start(server, 8888, "127.0.0.1");
 }